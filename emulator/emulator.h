@@ -0,0 +1,41 @@
+/* Robert Jordens <jordens@gmail.com>, 2014 */
+
+#ifndef __EMULATOR_H
+#define __EMULATOR_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Approximate CPU cycles per access. Everything else the CPU does
+ * takes no time, except waiting for the UART.
+ */
+#define EMULATOR_WB_CYCLES		4
+#define EMULATOR_CSR_CYCLES		8
+#define EMULATOR_IDLE_CYCLES	64
+/* interrupt entry and exit, saving and restoring the registers */
+#define EMULATOR_IRQ_CYCLES		64
+/* wishbone slave (DDS) wait states */
+#define EMULATOR_WB_WAIT		1
+
+#define EMULATOR_SYS_CLK		80000000
+/* bytes the UART buffers for sending */
+#define EMULATOR_UART_TX_RING	128
+#define EMULATOR_GPIO_MASK		0x3fffff
+
+/* master.c */
+void emulator_step(unsigned int cycles);
+uint64_t emulator_cycles(void);
+unsigned int emulator_irq_line(void);
+int emulator_busy(void);
+void emulator_push_trace(FILE *f);
+
+/* platform.c */
+void emulator_irq(void);
+int emulator_open(const char *link);
+void emulator_map(void);
+
+/* isr.c */
+void isr(void);
+
+#endif /* __EMULATOR_H */
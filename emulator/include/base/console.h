@@ -0,0 +1,4 @@
+#ifndef __CONSOLE_H
+#define __CONSOLE_H
+
+#endif /* __CONSOLE_H */
@@ -0,0 +1,6 @@
+#ifndef __CRC_H
+#define __CRC_H
+
+unsigned int crc32(const unsigned char *buffer, unsigned int len);
+
+#endif /* __CRC_H */
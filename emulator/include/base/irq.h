@@ -0,0 +1,11 @@
+#ifndef __IRQ_H
+#define __IRQ_H
+
+/* Interrupts are delivered synchronously, between model cycles */
+unsigned int irq_getie(void);
+void irq_setie(unsigned int ie);
+unsigned int irq_getmask(void);
+void irq_setmask(unsigned int mask);
+unsigned int irq_pending(void);
+
+#endif /* __IRQ_H */
@@ -0,0 +1,7 @@
+#ifndef __SYSTEM_H
+#define __SYSTEM_H
+
+void flush_cpu_icache(void);
+void flush_cpu_dcache(void);
+
+#endif /* __SYSTEM_H */
@@ -0,0 +1,83 @@
+#ifndef __GENERATED_CSR_H
+#define __GENERATED_CSR_H
+
+#include <stdint.h>
+
+/* The CSRs of the target the firmware uses, backed by the model */
+
+#define UART_INTERRUPT 0
+#define VENTILATOR_INTERRUPT 2
+
+uint32_t identifier_frequency_read(void);
+void uart_divisor_write(uint32_t value);
+
+void ventilator_ctrl_start_write(uint32_t value);
+void ventilator_ctrl_prohibit_write(uint32_t value);
+uint32_t ventilator_ctrl_prohibit_read(void);
+void ventilator_ctrl_clear_write(uint32_t value);
+uint32_t ventilator_ctrl_run_read(void);
+uint32_t ventilator_ctrl_cycle_read(void);
+void ventilator_ctrl_update_write(uint32_t value);
+uint32_t ventilator_ctrl_fine_read(void);
+
+uint32_t ventilator_ev_status_read(void);
+uint32_t ventilator_ev_pending_read(void);
+void ventilator_ev_pending_write(uint32_t value);
+uint32_t ventilator_ev_enable_read(void);
+void ventilator_ev_enable_write(uint32_t value);
+
+uint32_t ventilator_in_time_read(void);
+uint32_t ventilator_in_addr_read(void);
+uint32_t ventilator_in_data_read(void);
+void ventilator_in_next_write(uint32_t value);
+void ventilator_in_flush_write(uint32_t value);
+uint32_t ventilator_in_level_read(void);
+uint32_t ventilator_in_depth_read(void);
+
+void ventilator_out_time_write(uint32_t value);
+void ventilator_out_addr_write(uint32_t value);
+void ventilator_out_data_write(uint32_t value);
+void ventilator_out_next_write(uint32_t value);
+void ventilator_out_flush_write(uint32_t value);
+uint32_t ventilator_out_level_read(void);
+#define CSR_VENTILATOR_OUT_DEPTH_ADDR 1
+uint32_t ventilator_out_depth_read(void);
+
+#define CSR_VENTILATOR_COUNTERS_SNAPSHOT_ADDR 1
+void ventilator_counters_snapshot_write(uint32_t value);
+void ventilator_counters_clear_write(uint32_t value);
+uint32_t ventilator_out_high_read(void);
+uint32_t ventilator_in_high_read(void);
+uint32_t ventilator_ack_stalls_read(void);
+uint32_t ventilator_late_read(void);
+uint32_t ventilator_in_conflicts_read(void);
+uint32_t ventilator_out_drops_read(void);
+uint32_t ventilator_in_drops_read(void);
+uint32_t ventilator_dispatched0_read(void);
+#define CSR_VENTILATOR_DISPATCHED1_ADDR 1
+uint32_t ventilator_dispatched1_read(void);
+#define CSR_VENTILATOR_DISPATCHED2_ADDR 1
+uint32_t ventilator_dispatched2_read(void);
+
+#define CSR_VENTILATOR_TRACE_ARM_ADDR 1
+void ventilator_trace_arm_write(uint32_t value);
+void ventilator_trace_stop_write(uint32_t value);
+void ventilator_trace_sources_write(uint32_t value);
+void ventilator_trace_addr_write(uint32_t value);
+void ventilator_trace_mask_write(uint32_t value);
+void ventilator_trace_post_write(uint32_t value);
+uint32_t ventilator_trace_state_read(void);
+uint32_t ventilator_trace_trigger_cycle_read(void);
+uint32_t ventilator_trace_out_count_read(void);
+void ventilator_trace_out_index_write(uint32_t value);
+uint32_t ventilator_trace_out_cycle_read(void);
+uint32_t ventilator_trace_out_time_read(void);
+uint32_t ventilator_trace_out_addr_read(void);
+uint32_t ventilator_trace_out_data_read(void);
+uint32_t ventilator_trace_in_count_read(void);
+void ventilator_trace_in_index_write(uint32_t value);
+uint32_t ventilator_trace_in_time_read(void);
+uint32_t ventilator_trace_in_addr_read(void);
+uint32_t ventilator_trace_in_data_read(void);
+
+#endif /* __GENERATED_CSR_H */
@@ -0,0 +1,10 @@
+#ifndef __GENERATED_MEM_H
+#define __GENERATED_MEM_H
+
+/* Mapped at these addresses by the emulator */
+#define SRAM_BASE 0x10000000
+#define SRAM_SIZE 0x00002000
+#define SDRAM_BASE 0x40000000
+#define SDRAM_SIZE 0x00800000
+
+#endif /* __GENERATED_MEM_H */
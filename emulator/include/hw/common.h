@@ -0,0 +1,9 @@
+#ifndef __HW_COMMON_H
+#define __HW_COMMON_H
+
+#include <stdint.h>
+
+/* Only valid for the memory mapped by the emulator */
+#define MMPTR(x) (*((volatile unsigned int *)(uintptr_t)(x)))
+
+#endif /* __HW_COMMON_H */
@@ -0,0 +1,4 @@
+#ifndef __HW_FLAGS_H
+#define __HW_FLAGS_H
+
+#endif /* __HW_FLAGS_H */
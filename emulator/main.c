@@ -0,0 +1,55 @@
+/* Robert Jordens <jordens@gmail.com>, 2014 */
+
+/*
+ * Runs the firmware protocol loop and a kernel on the host against a
+ * model of the Master. Prints the pseudo terminal to talk to:
+ *
+ *	./ventilator-emulator -l /tmp/ventilator &
+ *	kernel/kernel.py -e -p /tmp/ventilator
+ *
+ * With -t, logs the pushed events to a file for kernel/validate.py.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ventilator.h"
+#include "emulator.h"
+
+ventilator_t *ventilator;
+
+int main(int argc, char **argv)
+{
+	const char *link = NULL;
+	FILE *f;
+	int c;
+	while ((c = getopt(argc, argv, "l:t:")) != -1) {
+		switch (c) {
+			case 'l':
+				link = optarg;
+				break;
+			case 't':
+				f = fopen(optarg, "w");
+				if (!f) {
+					perror(optarg);
+					return 1;
+				}
+				setvbuf(f, NULL, _IOLBF, 0);
+				emulator_push_trace(f);
+				break;
+			default:
+				fprintf(stderr, "usage: %s [-l link] [-t push trace]\n",
+						argv[0]);
+				return 1;
+		}
+	}
+	emulator_map();
+	if (emulator_open(link))
+		return 1;
+	ventilator_fast_init();
+	/* EXIT returns to the console on the target, start over here */
+	while (1)
+		ventilator_loop(0);
+	return 0;
+}
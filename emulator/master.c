@@ -0,0 +1,604 @@
+/* Robert Jordens <jordens@gmail.com>, 2014 */
+
+/*
+ * Cycle model of gateware/ventilator/master.py with the slaves of
+ * the target: CycleControl, HiresGpio with every output looped back
+ * to its input and the Wishbone bridge to a DDS register file stub.
+ *
+ * The model advances as the CPU accesses it: each register or CSR
+ * access costs a few cycles (emulator.h) and the main loop idles in
+ * uart_read_nonblock().
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <generated/csr.h>
+
+#include "ventilator.h"
+#include "emulator.h"
+
+#define SLAVES 3
+#define SLAVE_CTRL 0
+#define SLAVE_GPIO 1
+#define SLAVE_WB 2
+
+static const struct {
+	uint32_t prefix;
+	uint32_t mask;
+} slaves[SLAVES] = {
+	{VENTILATOR_CTRL, 0xffffff00},
+	{VENTILATOR_GPIO, 0xffffff00},
+	{VENTILATOR_WISHBONE, 0xe0000000},
+};
+
+/* Master(depth=), SyncFIFOBuffered holds one more */
+#define FIFO_DEPTH 256
+#define FIFO_CAPACITY (FIFO_DEPTH + 1)
+
+typedef struct fifo_t {
+	ventilator_event_t ev[FIFO_CAPACITY];
+	unsigned int head, level;
+} fifo_t;
+
+typedef struct din_t {
+	int stb;
+	uint32_t addr, data, phase;
+} din_t;
+
+static fifo_t in_fifo, out_fifo;
+static din_t din[SLAVES];
+
+static struct {
+	uint64_t cc;
+	uint32_t cycle, cycle_status;
+	int run, run0;
+	int start_in, start_out, prohibit_underflow, clear_force0, fine;
+	int prohibit, start_re, clear_re;
+	uint32_t out_time, out_addr, out_data;
+	uint32_t trigger, pending, enable;
+} m;
+
+static struct {
+	uint32_t o, o0, oe, r, f, b, i0;
+	unsigned int to;
+} gpio;
+
+#define WB_IDLE 0
+#define WB_BUS 1
+#define WB_QUEUE 2
+
+static struct {
+	int state;
+	unsigned int wait;
+	uint32_t adr, dat;
+	uint8_t dds[256];
+} wb;
+
+enum {
+	COUNTER_ACK_STALLS,
+	COUNTER_LATE,
+	COUNTER_IN_CONFLICTS,
+	COUNTER_OUT_DROPS,
+	COUNTER_IN_DROPS,
+	COUNTER_DISPATCHED,
+	COUNTERS = COUNTER_DISPATCHED + SLAVES
+};
+
+static struct {
+	uint32_t count[COUNTERS], status[COUNTERS];
+	uint32_t out_high, in_high, out_high_status, in_high_status;
+} counters;
+
+#define TRACE_DEPTH 512
+
+typedef struct trace_ring_t {
+	uint32_t ev[TRACE_DEPTH][4];
+	unsigned int ptr, count, index;
+} trace_ring_t;
+
+static struct {
+	uint32_t sources, addr, mask, post, post_left;
+	uint32_t state, trigger_cycle;
+	int run0;
+	trace_ring_t out, in;
+} trace;
+
+/* Levels are pending while their trigger is, processes on its fall */
+#define EV_LEVEL (VENTILATOR_EV_IN_READABLE | VENTILATOR_EV_IN_OVERFLOW)
+
+static ventilator_event_t *fifo_head(fifo_t *f)
+{
+	return &f->ev[f->head];
+}
+
+static void fifo_pop(fifo_t *f)
+{
+	if (!f->level)
+		return;
+	f->head = (f->head + 1) % FIFO_CAPACITY;
+	f->level--;
+}
+
+static int fifo_push(fifo_t *f, uint32_t time, uint32_t addr, uint32_t data)
+{
+	ventilator_event_t *ev;
+	if (f->level == FIFO_CAPACITY)
+		return 0;
+	ev = &f->ev[(f->head + f->level++) % FIFO_CAPACITY];
+	ev->time = time;
+	ev->addr = addr;
+	ev->data = data;
+	return 1;
+}
+
+static void trace_record(trace_ring_t *r, uint32_t a, uint32_t b,
+		uint32_t c, uint32_t d)
+{
+	r->ev[r->ptr][0] = a;
+	r->ev[r->ptr][1] = b;
+	r->ev[r->ptr][2] = c;
+	r->ev[r->ptr][3] = d;
+	r->ptr = (r->ptr + 1) % TRACE_DEPTH;
+	if (r->count != TRACE_DEPTH)
+		r->count++;
+}
+
+/* The entry at index of the ring, 0 is the oldest */
+static uint32_t *trace_entry(trace_ring_t *r)
+{
+	return r->ev[(r->ptr - r->count + r->index) % TRACE_DEPTH];
+}
+
+static void trace_cycle(const ventilator_event_t *out,
+		const ventilator_event_t *in, int late)
+{
+	int armed = trace.state & VENTILATOR_TRACE_ARMED;
+	int triggered = trace.state & VENTILATOR_TRACE_TRIGGERED;
+	int trigger;
+	trigger = armed && !triggered && (
+		((trace.sources & VENTILATOR_TRACE_SOURCE_OUT) && out &&
+		 ((out->addr & trace.mask) == trace.addr)) ||
+		((trace.sources & VENTILATOR_TRACE_SOURCE_IN) && in &&
+		 ((in->addr & trace.mask) == trace.addr)) ||
+		((trace.sources & VENTILATOR_TRACE_SOURCE_LATE) && late) ||
+		((trace.sources & VENTILATOR_TRACE_SOURCE_STOP) &&
+		 trace.run0 && !m.run));
+	trace.run0 = m.run;
+	if (!armed)
+		return;
+	if (out)
+		trace_record(&trace.out, m.cycle, out->time, out->addr, out->data);
+	if (in)
+		trace_record(&trace.in, in->time, in->addr, in->data, 0);
+	if (trigger) {
+		trace.state |= VENTILATOR_TRACE_TRIGGERED;
+		trace.post_left = trace.post;
+		trace.trigger_cycle = m.cycle;
+		if (!trace.post)
+			trace.state &= ~VENTILATOR_TRACE_ARMED;
+	} else if (triggered && (out || in)) {
+		if (trace.post_left == 1)
+			trace.state &= ~VENTILATOR_TRACE_ARMED;
+		trace.post_left--;
+	}
+}
+
+static int slave_select(uint32_t addr)
+{
+	int i;
+	for (i=0; i<SLAVES; i++)
+		if ((addr & slaves[i].mask) == slaves[i].prefix)
+			return i;
+	return -1;
+}
+
+static uint32_t gpio_in(void)
+{
+	return ((gpio.o & gpio.oe) ^ gpio.b) & EMULATOR_GPIO_MASK;
+}
+
+/*
+ * The end of a cycle for the Gpio, dout is the dispatched event or 0,
+ * phase its fine time phase
+ */
+static void gpio_sync(const ventilator_event_t *dout, uint32_t phase, int acked)
+{
+	uint32_t i = gpio_in(), rise, fall, sel, a;
+	int read = dout && !(dout->addr & 0xf);
+	if (din[SLAVE_GPIO].stb && acked)
+		din[SLAVE_GPIO].stb = 0;
+	if (dout) {
+		gpio.to = m.fine ? phase : (dout->addr >> 4) & 7;
+		din[SLAVE_GPIO].addr = 0;
+		din[SLAVE_GPIO].phase = 0;
+		switch (dout->addr & 0xf) {
+			case 0x0:
+				din[SLAVE_GPIO].stb = 1;
+				din[SLAVE_GPIO].data = i;
+				break;
+			case 0x1:
+				gpio.o0 = gpio.o;
+				gpio.o = dout->data ^ gpio.b;
+				break;
+			case 0x2:
+				gpio.oe = dout->data;
+				break;
+			case 0x3:
+				gpio.r = dout->data;
+				break;
+			case 0x4:
+				gpio.f = dout->data;
+				break;
+			case 0x5:
+				gpio.b = dout->data;
+				break;
+		}
+	}
+	if (read || din[SLAVE_GPIO].stb)
+		return;
+	rise = ~gpio.i0 & gpio.r & i;
+	fall = gpio.i0 & gpio.f & ~i;
+	sel = (rise | fall) & -(rise | fall);
+	a = gpio.i0 & sel;
+	gpio.i0 = i;
+	if (!sel)
+		return;
+	/* looped back: the edge is where the output put it */
+	din[SLAVE_GPIO].stb = 1;
+	din[SLAVE_GPIO].addr = (m.fine ? 0 : gpio.to << 4) | (a ? 0x7 : 0x6);
+	din[SLAVE_GPIO].phase = gpio.to;
+	din[SLAVE_GPIO].data = a ? fall : rise;
+}
+
+static void wb_sync(const ventilator_event_t *dout, int acked)
+{
+	switch (wb.state) {
+		case WB_IDLE:
+			if (!dout)
+				break;
+			wb.adr = dout->addr;
+			wb.dat = dout->data;
+			wb.wait = EMULATOR_WB_WAIT;
+			wb.state = WB_BUS;
+			break;
+		case WB_BUS:
+			if (wb.wait) {
+				wb.wait--;
+				break;
+			}
+			if (wb.adr & VENTILATOR_WISHBONE_W) {
+				wb.dds[wb.adr & 0xff] = wb.dat;
+				wb.state = WB_IDLE;
+			} else {
+				din[SLAVE_WB].stb = 1;
+				din[SLAVE_WB].addr = wb.adr;
+				din[SLAVE_WB].data = wb.dds[wb.adr & 0xff];
+				wb.state = WB_QUEUE;
+			}
+			break;
+		case WB_QUEUE:
+			if (acked) {
+				din[SLAVE_WB].stb = 0;
+				wb.state = WB_IDLE;
+			}
+			break;
+	}
+}
+
+static void master_cycle(void)
+{
+	ventilator_event_t *head = fifo_head(&out_fifo), dout;
+	int have_out = out_fifo.level != 0, have_in, request, re = 0;
+	int stop, start, stop_once = 0, clear_force = 0, slave = -1;
+	int in = -1, i, n, late;
+	uint32_t diff, trigger, now, at, phase = 0;
+	ventilator_event_t din_ev;
+
+	start = m.start_re || (m.start_out && have_out);
+	stop = m.prohibit || (m.prohibit_underflow && !have_out);
+	m.run = stop ? 0 : start ? 1 : m.run0;
+	m.start_re = 0;
+
+	/* dispatch, fine time counts 1/8 cycles */
+	if (m.fine) {
+		now = m.cycle << 3;
+		at = head->time & ~7;
+		phase = head->time & 7;
+	} else {
+		now = m.cycle;
+		at = head->time;
+	}
+	request = have_out && m.run && (now == at);
+	if (request) {
+		dout = *head;
+		slave = slave_select(dout.addr);
+		/* all slaves ack, unmapped addresses stall */
+		re = slave >= 0;
+	}
+	if (re && (slave == SLAVE_CTRL)) {
+		switch (dout.addr & 0xff) {
+			case 0x00:
+				din[SLAVE_CTRL].stb = 1;
+				din[SLAVE_CTRL].addr = 0;
+				din[SLAVE_CTRL].data = dout.data;
+				break;
+			case 0x04:
+				stop_once = 1;
+				break;
+			case 0x05:
+				clear_force = dout.data != 0;
+				break;
+		}
+	}
+
+	/* arbitrate, lowest slave first */
+	n = 0;
+	for (i=SLAVES-1; i>=0; i--)
+		if (din[i].stb) {
+			in = i;
+			n++;
+		}
+	have_in = n != 0;
+	if (have_in && m.run) {
+		if (n > 1)
+			counters.count[COUNTER_IN_CONFLICTS]++;
+		din_ev.time = now | (m.fine ? din[in].phase : 0);
+		din_ev.addr = slaves[in].prefix | (din[in].addr & ~slaves[in].mask);
+		din_ev.data = din[in].data;
+		if (!fifo_push(&in_fifo, din_ev.time, din_ev.addr, din_ev.data))
+			counters.count[COUNTER_IN_DROPS]++;
+	} else {
+		in = -1;
+	}
+
+	/* counters */
+	diff = now - at;
+	late = have_out && m.run && diff && !(diff >> 30);
+	if (late)
+		counters.count[COUNTER_LATE]++;
+	if (request && !re)
+		counters.count[COUNTER_ACK_STALLS]++;
+	if (re)
+		counters.count[COUNTER_DISPATCHED + slave]++;
+	trace_cycle(re ? &dout : 0, in >= 0 ? &din_ev : 0, late);
+
+	/* clock edge */
+	if (re)
+		fifo_pop(&out_fifo);
+	din[SLAVE_CTRL].stb = 0;
+	gpio_sync(re && (slave == SLAVE_GPIO) ? &dout : 0, phase,
+			in == SLAVE_GPIO);
+	wb_sync(re && (slave == SLAVE_WB) ? &dout : 0, in == SLAVE_WB);
+	if (re && (slave == SLAVE_CTRL)) {
+		switch (dout.addr & 0xff) {
+			case 0x01:
+				m.start_in = dout.data;
+				break;
+			case 0x02:
+				m.start_out = dout.data;
+				break;
+			case 0x03:
+				m.prohibit_underflow = dout.data;
+				break;
+			case 0x05:
+				m.clear_force0 = dout.data;
+				break;
+			case 0x06:
+				m.fine = dout.data & 1;
+				break;
+		}
+	}
+	if (m.clear_re)
+		m.fine = 0;
+	if (stop_once)
+		m.run0 = 0;
+	else if (m.start_in && have_in)
+		m.run0 = 1;
+	else
+		m.run0 = m.run;
+	if (m.clear_re || clear_force || m.clear_force0)
+		m.cycle = 0;
+	else if (m.run && !++m.cycle)
+		m.pending |= VENTILATOR_EV_WRAP; /* a pulse */
+	m.clear_re = 0;
+
+	counters.out_high = max(counters.out_high, out_fifo.level);
+	counters.in_high = max(counters.in_high, in_fifo.level);
+
+	trigger = 0;
+	if (in_fifo.level)
+		trigger |= VENTILATOR_EV_IN_READABLE;
+	if (out_fifo.level == FIFO_CAPACITY)
+		trigger |= VENTILATOR_EV_OUT_OVERFLOW;
+	if (in_fifo.level == FIFO_CAPACITY)
+		trigger |= VENTILATOR_EV_IN_OVERFLOW;
+	if (out_fifo.level)
+		trigger |= VENTILATOR_EV_OUT_READABLE;
+	trigger |= m.run ? VENTILATOR_EV_STOPPED : VENTILATOR_EV_STARTED;
+	m.pending |= m.trigger & ~trigger & ~EV_LEVEL;
+	m.trigger = trigger;
+}
+
+/* Interrupts are taken before an access, never during one */
+void emulator_step(unsigned int cycles)
+{
+	emulator_irq();
+	for (; cycles; cycles--, m.cc++)
+		master_cycle();
+}
+
+unsigned int emulator_irq_line(void)
+{
+	return ((m.pending | (m.trigger & EV_LEVEL)) & m.enable) != 0;
+}
+
+/* Whether the model has anything to do */
+int emulator_busy(void)
+{
+	return (m.run && out_fifo.level) || din[SLAVE_GPIO].stb ||
+		(wb.state != WB_IDLE);
+}
+
+uint64_t emulator_cycles(void)
+{
+	return m.cc;
+}
+
+uint32_t ventilator_emulator_cc(void)
+{
+	return m.cc;
+}
+
+static FILE *push_trace;
+
+/* Logs the pushed events for kernel/validate.py: CPU cycle, event */
+void emulator_push_trace(FILE *f)
+{
+	push_trace = f;
+}
+
+static void out_next(void)
+{
+	if (push_trace)
+		fprintf(push_trace, "%llu %u %#x %#x\n", (unsigned long long) m.cc,
+				m.out_time, m.out_addr, m.out_data);
+	if (!fifo_push(&out_fifo, m.out_time, m.out_addr, m.out_data))
+		counters.count[COUNTER_OUT_DROPS]++;
+}
+
+/*
+ * The wishbone registers. Reads and strobes act at the end of the
+ * access, the caller stores to or loads from the pointer.
+ */
+volatile uint32_t *ventilator_emulator_reg(unsigned int x)
+{
+	static uint32_t reg;
+	ventilator_event_t *head;
+	emulator_step(EMULATOR_WB_CYCLES);
+	head = fifo_head(&in_fifo);
+	reg = 0;
+	switch (x) {
+		case 0x0:
+			reg = m.cycle;
+			break;
+		case 0x1:
+			reg = m.trigger;
+			break;
+		case 0x2:
+			reg = head->time;
+			break;
+		case 0x3:
+			reg = head->addr;
+			break;
+		case 0x4:
+			reg = head->data;
+			break;
+		case 0x5:
+			fifo_pop(&in_fifo);
+			break;
+		case 0x6:
+			return &m.out_time;
+		case 0x7:
+			return &m.out_addr;
+		case 0x8:
+			return &m.out_data;
+		case 0x9:
+			out_next();
+			break;
+		case 0xa:
+			reg = out_fifo.level;
+			break;
+		case 0xb:
+			reg = in_fifo.level;
+			break;
+	}
+	return &reg;
+}
+
+#define CSR_READ(name, value) \
+	uint32_t name##_read(void) \
+	{ \
+		emulator_step(EMULATOR_CSR_CYCLES); \
+		return (value); \
+	}
+
+#define CSR_WRITE(name, action) \
+	void name##_write(uint32_t value) \
+	{ \
+		emulator_step(EMULATOR_CSR_CYCLES); \
+		action; \
+	}
+
+CSR_WRITE(ventilator_ctrl_start, m.start_re = 1)
+CSR_WRITE(ventilator_ctrl_prohibit, m.prohibit = value & 1)
+CSR_READ(ventilator_ctrl_prohibit, m.prohibit)
+CSR_WRITE(ventilator_ctrl_clear, m.clear_re = 1)
+CSR_READ(ventilator_ctrl_run, m.run0)
+CSR_READ(ventilator_ctrl_cycle, m.cycle_status)
+CSR_WRITE(ventilator_ctrl_update, m.cycle_status = m.cycle)
+CSR_READ(ventilator_ctrl_fine, m.fine)
+
+CSR_READ(ventilator_ev_status, m.trigger)
+CSR_READ(ventilator_ev_pending, m.pending | (m.trigger & EV_LEVEL))
+CSR_WRITE(ventilator_ev_pending, m.pending &= ~value)
+CSR_READ(ventilator_ev_enable, m.enable)
+CSR_WRITE(ventilator_ev_enable, m.enable = value & 0x7f)
+
+CSR_READ(ventilator_in_time, fifo_head(&in_fifo)->time)
+CSR_READ(ventilator_in_addr, fifo_head(&in_fifo)->addr)
+CSR_READ(ventilator_in_data, fifo_head(&in_fifo)->data)
+CSR_WRITE(ventilator_in_next, fifo_pop(&in_fifo))
+CSR_WRITE(ventilator_in_flush, in_fifo.level = 0)
+CSR_READ(ventilator_in_level, in_fifo.level)
+CSR_READ(ventilator_in_depth, FIFO_CAPACITY)
+
+CSR_WRITE(ventilator_out_time, m.out_time = value)
+CSR_WRITE(ventilator_out_addr, m.out_addr = value)
+CSR_WRITE(ventilator_out_data, m.out_data = value)
+CSR_WRITE(ventilator_out_next, out_next())
+CSR_WRITE(ventilator_out_flush, out_fifo.level = 0)
+CSR_READ(ventilator_out_level, out_fifo.level)
+CSR_READ(ventilator_out_depth, FIFO_CAPACITY)
+
+CSR_WRITE(ventilator_counters_snapshot,
+		memcpy(counters.status, counters.count, sizeof(counters.count));
+		counters.out_high_status = counters.out_high;
+		counters.in_high_status = counters.in_high)
+CSR_WRITE(ventilator_counters_clear,
+		memset(counters.count, 0, sizeof(counters.count));
+		counters.out_high = counters.in_high = 0)
+CSR_READ(ventilator_out_high, counters.out_high_status)
+CSR_READ(ventilator_in_high, counters.in_high_status)
+CSR_READ(ventilator_ack_stalls, counters.status[COUNTER_ACK_STALLS])
+CSR_READ(ventilator_late, counters.status[COUNTER_LATE])
+CSR_READ(ventilator_in_conflicts, counters.status[COUNTER_IN_CONFLICTS])
+CSR_READ(ventilator_out_drops, counters.status[COUNTER_OUT_DROPS])
+CSR_READ(ventilator_in_drops, counters.status[COUNTER_IN_DROPS])
+CSR_READ(ventilator_dispatched0, counters.status[COUNTER_DISPATCHED + 0])
+CSR_READ(ventilator_dispatched1, counters.status[COUNTER_DISPATCHED + 1])
+CSR_READ(ventilator_dispatched2, counters.status[COUNTER_DISPATCHED + 2])
+
+CSR_WRITE(ventilator_trace_arm,
+		trace.out.ptr = trace.out.count = 0;
+		trace.in.ptr = trace.in.count = 0;
+		trace.state = VENTILATOR_TRACE_ARMED)
+CSR_WRITE(ventilator_trace_stop, trace.state &= ~VENTILATOR_TRACE_ARMED)
+CSR_WRITE(ventilator_trace_sources, trace.sources = value & 0xf)
+CSR_WRITE(ventilator_trace_addr, trace.addr = value)
+CSR_WRITE(ventilator_trace_mask, trace.mask = value)
+CSR_WRITE(ventilator_trace_post, trace.post = value)
+CSR_READ(ventilator_trace_state, trace.state)
+CSR_READ(ventilator_trace_trigger_cycle, trace.trigger_cycle)
+CSR_READ(ventilator_trace_out_count, trace.out.count)
+CSR_WRITE(ventilator_trace_out_index, trace.out.index = value % TRACE_DEPTH)
+CSR_READ(ventilator_trace_out_cycle, trace_entry(&trace.out)[0])
+CSR_READ(ventilator_trace_out_time, trace_entry(&trace.out)[1])
+CSR_READ(ventilator_trace_out_addr, trace_entry(&trace.out)[2])
+CSR_READ(ventilator_trace_out_data, trace_entry(&trace.out)[3])
+CSR_READ(ventilator_trace_in_count, trace.in.count)
+CSR_WRITE(ventilator_trace_in_index, trace.in.index = value % TRACE_DEPTH)
+CSR_READ(ventilator_trace_in_time, trace_entry(&trace.in)[0])
+CSR_READ(ventilator_trace_in_addr, trace_entry(&trace.in)[1])
+CSR_READ(ventilator_trace_in_data, trace_entry(&trace.in)[2])
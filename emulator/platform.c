@@ -0,0 +1,245 @@
+/* Robert Jordens <jordens@gmail.com>, 2014 */
+
+/* What libbase and the CPU provide on the target */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <irq.h>
+#include <uart.h>
+#include <system.h>
+#include <crc.h>
+#include <generated/csr.h>
+#include <generated/mem.h>
+
+#include "ventilator.h"
+#include "emulator.h"
+
+static unsigned int ie, mask, in_isr;
+
+unsigned int irq_getie(void)
+{
+	return ie;
+}
+
+void irq_setie(unsigned int value)
+{
+	ie = value;
+	emulator_irq();
+}
+
+unsigned int irq_getmask(void)
+{
+	return mask;
+}
+
+void irq_setmask(unsigned int value)
+{
+	mask = value;
+	emulator_irq();
+}
+
+unsigned int irq_pending(void)
+{
+	return emulator_irq_line() << VENTILATOR_INTERRUPT;
+}
+
+/* Like the CPU: clears IE for the handler and restores it on return */
+void emulator_irq(void)
+{
+	if (!ie || in_isr || !(irq_pending() & mask))
+		return;
+	in_isr = 1;
+	ie = 0;
+	emulator_step(EMULATOR_IRQ_CYCLES/2);
+	isr();
+	emulator_step(EMULATOR_IRQ_CYCLES/2);
+	ie = 1;
+	in_isr = 0;
+}
+
+static int fd = -1, fd_slave = -1;
+static uint32_t divisor = EMULATOR_SYS_CLK/115200/16;
+static uint64_t tx_done; /* when the UART has sent everything */
+
+/* At line rate: 8N1 at 16 samples per bit */
+static unsigned int uart_byte_cycles(void)
+{
+	return 10*16*divisor;
+}
+
+static struct {
+	unsigned int len, pos;
+	uint8_t buf[4096];
+} rx, tx;
+
+void uart_init(void)
+{
+}
+
+void uart_isr(void)
+{
+}
+
+void uart_sync(void)
+{
+	unsigned int i;
+	ssize_t n;
+	for (i=0; i<tx.len; i+=n) {
+		n = write(fd, tx.buf + i, tx.len - i);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				perror("write");
+				exit(1);
+			}
+			poll(&(struct pollfd) {.fd = fd, .events = POLLOUT}, 1, -1);
+			n = 0;
+		}
+	}
+	tx.len = 0;
+}
+
+/* Blocks while the transmit ring is full */
+void uart_write(char c)
+{
+	uint64_t now = emulator_cycles();
+	unsigned int t = uart_byte_cycles();
+	if (tx_done < now)
+		tx_done = now;
+	if (tx_done - now > EMULATOR_UART_TX_RING*t)
+		emulator_step(tx_done - now - EMULATOR_UART_TX_RING*t);
+	tx_done += t;
+	if (tx.len == sizeof(tx.buf))
+		uart_sync();
+	tx.buf[tx.len++] = c;
+}
+
+/*
+ * The main loop spins here. Time passes while there is nothing to
+ * read and the process sleeps if the model has nothing to do.
+ */
+int uart_read_nonblock(void)
+{
+	ssize_t n;
+	if (rx.pos < rx.len)
+		return 1;
+	uart_sync();
+	n = read(fd, rx.buf, sizeof(rx.buf));
+	if (n > 0) {
+		rx.pos = 0;
+		rx.len = n;
+		return 1;
+	}
+	emulator_step(EMULATOR_IDLE_CYCLES);
+	if (!emulator_busy())
+		poll(&(struct pollfd) {.fd = fd, .events = POLLIN}, 1, 1);
+	return 0;
+}
+
+/* At line rate */
+char uart_read(void)
+{
+	while (!uart_read_nonblock());
+	emulator_step(uart_byte_cycles());
+	return rx.buf[rx.pos++];
+}
+
+/* Returns the pseudo terminal to talk to, links to it from link */
+int emulator_open(const char *link)
+{
+	struct termios t;
+	const char *name;
+	fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if ((fd < 0) || grantpt(fd) || unlockpt(fd) || !(name = ptsname(fd))) {
+		perror("pty");
+		return -1;
+	}
+	/* keep the slave open: no hangups between host sessions */
+	fd_slave = open(name, O_RDWR | O_NOCTTY);
+	if (fd_slave < 0 || tcgetattr(fd_slave, &t)) {
+		perror(name);
+		return -1;
+	}
+	cfmakeraw(&t);
+	tcsetattr(fd_slave, TCSANOW, &t);
+	if (link) {
+		unlink(link);
+		if (symlink(name, link)) {
+			perror(link);
+			return -1;
+		}
+	}
+	printf("%s\n", name);
+	fflush(stdout);
+	return 0;
+}
+
+static void emulator_map1(uint32_t base, uint32_t size)
+{
+	void *p = mmap((void *) (uintptr_t) base, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (p != (void *) (uintptr_t) base) {
+		fprintf(stderr, "can not map 0x%08x\n", base);
+		exit(1);
+	}
+}
+
+/* Kernels are loaded and allocate at their target addresses */
+void emulator_map(void)
+{
+	emulator_map1(SRAM_BASE, SRAM_SIZE);
+	emulator_map1(SDRAM_BASE, SDRAM_SIZE);
+	if ((uintptr_t) &ventilator_kernel >> 32) {
+		fprintf(stderr, "ventilator_kernel above 4 GiB, link with -no-pie\n");
+		exit(1);
+	}
+}
+
+/*
+ * The kernel is linked in. The image at adr only carries the ABI
+ * version in its second word, the heap starts after those two words.
+ */
+uint64_t ventilator_emulator_boot(uint32_t adr)
+{
+	return ((uint64_t) (uintptr_t) &ventilator_kernel << 32) |
+		(adr + 2*sizeof(uint32_t));
+}
+
+void flush_cpu_icache(void)
+{
+}
+
+void flush_cpu_dcache(void)
+{
+}
+
+unsigned int crc32(const unsigned char *buffer, unsigned int len)
+{
+	unsigned int crc = 0xffffffff;
+	int i;
+	while (len--) {
+		crc ^= *buffer++;
+		for (i=0; i<8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+uint32_t identifier_frequency_read(void)
+{
+	return EMULATOR_SYS_CLK;
+}
+
+void uart_divisor_write(uint32_t value)
+{
+	divisor = value;
+}
@@ -122,6 +122,8 @@ class HiresGpio(Slave):
 	* opposite edges on lower priority pins
 
 	latency is 2 + oserdes2 out and iserdes2 + 2 in
+
+	the edge phase is addr[4:7] or, in fine time, the phase
 	"""
 	def __init__(self, pads, pads_n=None, cdmap=None):
 		super(HiresGpio, self).__init__()
@@ -211,8 +213,10 @@ class HiresGpio(Slave):
 					self.din.stb.eq(0),
 				),
 				If(self.dout.stb,
-					to.eq(self.dout.payload.addr[4:]),
+					to.eq(Mux(self.fine, self.dout.payload.phase,
+						self.dout.payload.addr[4:])),
 					self.din.payload.addr.eq(0),
+					self.din.payload.phase.eq(0),
 					Case(self.dout.payload.addr[:4], {
 						0x0: [self.din.stb.eq(1), self.din.payload.data.eq(i)],
 						0x1: [o.eq(self.dout.payload.data ^ b), o0.eq(o)],
@@ -227,7 +231,8 @@ class HiresGpio(Slave):
 					i0.eq(i),
 					If(~pe_sel.n,
 						self.din.stb.eq(1),
-						self.din.payload.addr[4:].eq(ti),
+						self.din.payload.addr[4:].eq(Mux(self.fine, 0, ti)),
+						self.din.payload.phase.eq(ti),
 						self.din.payload.addr[:4].eq(Mux(~i0i, 0x6, 0x7)),
 						self.din.payload.data.eq(Mux(~i0i, rise_in, fall_in)),
 					),
@@ -5,9 +5,10 @@ from migen.genlib.misc import optree
 from migen.bus import wishbone
 from migen.bank.description import CSR, CSRStorage, CSRStatus, AutoCSR
 from migen.bank.eventmanager import (EventManager, EventSourceLevel,
-		EventSourceProcess)
+		EventSourceProcess, EventSourcePulse)
 from migen.genlib.fifo import SyncFIFOBuffered
 from migen.genlib.coding import PriorityEncoder
+from migen.genlib.record import Record
 from migen.flow.actor import Source, Sink
 
 from .slave import ventilator_layout, slave_layout, Slave
@@ -23,11 +24,13 @@ class CycleControl(Slave, AutoCSR):
 		self._run = CSRStatus()
 		self._cycle = CSRStatus(time_width)
 		self._update = CSR()
+		self._fine = CSRStatus()
 
 		self.have_out = Signal()
 		self.have_in = Signal()
 		self.cycle = Signal(time_width)
 		self.run = Signal()
+		self.wrap = Signal()
 
 		###
 
@@ -47,11 +50,15 @@ class CycleControl(Slave, AutoCSR):
 
 		self.comb += [
 				self._run.status.eq(run0),
+				self._fine.status.eq(self.fine),
 				start.eq(self._start.re |
 					(start_out & self.have_out)),
 				stop.eq(self._prohibit.storage |
 					(prohibit_underflow & ~self.have_out)),
 				clear.eq(self._clear.re | clear_force | clear_force0),
+				# counted over, not cleared
+				self.wrap.eq(self.run & ~clear &
+					(self.cycle == 2**time_width - 1)),
 				If(stop,
 					self.run.eq(0),
 				).Elif(start,
@@ -80,8 +87,12 @@ class CycleControl(Slave, AutoCSR):
 						0x02: start_out.eq(self.dout.payload.data),
 						0x03: prohibit_underflow.eq(self.dout.payload.data),
 						0x05: clear_force0.eq(self.dout.payload.data),
+						0x06: self.fine.eq(self.dout.payload.data),
 						}),
 				),
+				If(self._clear.re,
+					self.fine.eq(0),
+				),
 				If(stop_once,
 					run0.eq(0),
 				).Elif(start_in & self.have_in,
@@ -99,6 +110,147 @@ class CycleControl(Slave, AutoCSR):
 				),
 				]
 
+class _TraceRing(Module):
+	def __init__(self, layout, depth):
+		self.stb = Signal()
+		self.we = Signal()
+		self.clear = Signal()
+		self.din = Record(layout)
+		self.index = Signal(log2_int(depth))
+		self.dout = Record(layout)
+		self.count = Signal(bits_for(depth))
+
+		###
+
+		mem = Memory(flen(self.din), depth)
+		wp = mem.get_port(write_capable=True)
+		rp = mem.get_port()
+		self.specials += mem, wp, rp
+
+		ptr = Signal(log2_int(depth))
+		self.comb += [
+				wp.adr.eq(ptr),
+				wp.dat_w.eq(self.din.raw_bits()),
+				wp.we.eq(self.stb & self.we),
+				# oldest first
+				rp.adr.eq(ptr - self.count + self.index),
+				self.dout.raw_bits().eq(rp.dat_r),
+				]
+		self.sync += [
+				If(self.clear,
+					ptr.eq(0),
+					self.count.eq(0),
+				).Elif(wp.we,
+					ptr.eq(ptr + 1),
+					If(self.count != depth,
+						self.count.eq(self.count + 1),
+					),
+				),
+				]
+
+class Trace(Module, AutoCSR):
+	"""Post-mortem event trace
+	* out ring: dispatched events with their dispatch cycle
+	* in ring: accepted input events (time is the cycle)
+	* arm clears the rings and records, they keep the last depth events
+	* trigger on the enabled sources: out or in address match under
+	  mask, late head, run stopping. Records post more cycles with
+	  events afterwards, then stops. Software can stop at any time.
+	* read: write the index (0 is the oldest), read the entry
+	"""
+	SOURCE_OUT = 1
+	SOURCE_IN = 2
+	SOURCE_LATE = 4
+	SOURCE_STOP = 8
+
+	def __init__(self, depth):
+		time_width, addr_width, data_width = [_[1] for _ in ventilator_layout]
+		out_layout = [("cycle", time_width)] + ventilator_layout
+
+		self._arm = CSR()
+		self._stop = CSR()
+		self._sources = CSRStorage(4)
+		self._addr = CSRStorage(addr_width)
+		self._mask = CSRStorage(addr_width)
+		self._post = CSRStorage(32)
+		self._state = CSRStatus(2)
+		self._trigger_cycle = CSRStatus(time_width)
+		self._out_count = CSRStatus(bits_for(depth))
+		self._out_index = CSRStorage(log2_int(depth))
+		self._out_cycle = CSRStatus(time_width)
+		self._out_time = CSRStatus(time_width)
+		self._out_addr = CSRStatus(addr_width)
+		self._out_data = CSRStatus(data_width)
+		self._in_count = CSRStatus(bits_for(depth))
+		self._in_index = CSRStorage(log2_int(depth))
+		self._in_time = CSRStatus(time_width)
+		self._in_addr = CSRStatus(addr_width)
+		self._in_data = CSRStatus(data_width)
+
+		self.cycle = Signal(time_width)
+		self.run = Signal()
+		self.late = Signal()
+
+		###
+
+		self.submodules.out = out = _TraceRing(out_layout, depth)
+		self.submodules.inp = inp = _TraceRing(ventilator_layout, depth)
+
+		armed = Signal()
+		triggered = Signal()
+		post = Signal(32)
+		run0 = Signal()
+		trigger = Signal()
+
+		sources = self._sources.storage
+		addr = self._addr.storage
+		mask = self._mask.storage
+		self.comb += [
+				out.din.cycle.eq(self.cycle),
+				out.we.eq(armed),
+				out.clear.eq(self._arm.re),
+				out.index.eq(self._out_index.storage),
+				inp.we.eq(armed),
+				inp.clear.eq(self._arm.re),
+				inp.index.eq(self._in_index.storage),
+				trigger.eq(armed & ~triggered & (
+					(sources[0] & out.stb & (out.din.addr & mask == addr)) |
+					(sources[1] & inp.stb & (inp.din.addr & mask == addr)) |
+					(sources[2] & self.late) |
+					(sources[3] & run0 & ~self.run))),
+				self._state.status.eq(Cat(armed, triggered)),
+				self._out_count.status.eq(out.count),
+				self._out_cycle.status.eq(out.dout.cycle),
+				self._out_time.status.eq(out.dout.time),
+				self._out_addr.status.eq(out.dout.addr),
+				self._out_data.status.eq(out.dout.data),
+				self._in_count.status.eq(inp.count),
+				self._in_time.status.eq(inp.dout.time),
+				self._in_addr.status.eq(inp.dout.addr),
+				self._in_data.status.eq(inp.dout.data),
+				]
+		self.sync += [
+				run0.eq(self.run),
+				If(self._arm.re,
+					armed.eq(1),
+					triggered.eq(0),
+				).Elif(self._stop.re,
+					armed.eq(0),
+				).Elif(trigger,
+					triggered.eq(1),
+					post.eq(self._post.storage),
+					self._trigger_cycle.status.eq(self.cycle),
+					If(self._post.storage == 0,
+						armed.eq(0),
+					),
+				).Elif(armed & triggered & (out.stb | inp.stb),
+					If(post == 1,
+						armed.eq(0),
+					),
+					post.eq(post - 1),
+				),
+				]
+
 class Master(Module, AutoCSR):
 	"""Hard timing adapter
 	* exposed via wishbone and csr
@@ -109,8 +261,13 @@ class Master(Module, AutoCSR):
 	* downstream only see addr/data stb/ack
 	* device nop/loopback: nop read and write address for wraps
 	* lowest slave has priority on din
+	* optional event trace of trace_depth (power of two) per direction
+	* fine time (ctrl 0x06, off on clear): times count 1/8 cycles,
+	    dispatch at time>>3, slaves get time&7 as phase,
+	    inputs are tagged cycle<<3|phase
 	"""
-	def __init__(self, slaves, depth=256, bus=None, with_wishbone=True):
+	def __init__(self, slaves, depth=256, bus=None, with_wishbone=True,
+			trace_depth=512):
 		time_width, addr_width, data_width = [_[1] for _ in ventilator_layout]
 
 		self.submodules.ctrl = CycleControl()
@@ -122,6 +279,7 @@ class Master(Module, AutoCSR):
 		ev.out_readable = EventSourceProcess()
 		ev.stopped = EventSourceProcess()
 		ev.started = EventSourceProcess()
+		ev.wrap = EventSourcePulse()
 		ev.finalize()
 
 		self._in_time = CSRStatus(time_width)
@@ -129,12 +287,28 @@ class Master(Module, AutoCSR):
 		self._in_data = CSRStatus(data_width)
 		self._in_next = CSR()
 		self._in_flush = CSR()
+		self._in_level = CSRStatus(bits_for(depth + 1))
+		# SyncFIFOBuffered holds depth + 1
+		self._in_depth = CSRStatus(bits_for(depth + 1), reset=depth + 1)
 
 		self._out_time = CSRStorage(time_width, write_from_dev=with_wishbone)
 		self._out_addr = CSRStorage(addr_width, write_from_dev=with_wishbone)
 		self._out_data = CSRStorage(data_width, write_from_dev=with_wishbone)
 		self._out_next = CSR()
 		self._out_flush = CSR()
+		self._out_level = CSRStatus(bits_for(depth + 1))
+		self._out_depth = CSRStatus(bits_for(depth + 1), reset=depth + 1)
+
+		# performance counters, read the snapshot
+		self._counters_snapshot = CSR()
+		self._counters_clear = CSR()
+		self._out_high = CSRStatus(bits_for(depth + 1))
+		self._in_high = CSRStatus(bits_for(depth + 1))
+		self._ack_stalls = CSRStatus(32)
+		self._late = CSRStatus(32)
+		self._in_conflicts = CSRStatus(32)
+		self._out_drops = CSRStatus(32)
+		self._in_drops = CSRStatus(32)
 
 		self.busy = Signal()
 
@@ -157,6 +331,9 @@ class Master(Module, AutoCSR):
 		wb_out_next = Signal()
 		out_request = Signal()
 		in_request = Signal()
+		now = Signal(time_width)
+		at = Signal(time_width)
+		phase = Signal(3)
 
 		# CSRs and Events
 		self.comb += [
@@ -166,6 +343,7 @@ class Master(Module, AutoCSR):
 				ev.out_readable.trigger.eq(out_fifo.readable),
 				ev.started.trigger.eq(~self.ctrl.run),
 				ev.stopped.trigger.eq(self.ctrl.run),
+				ev.wrap.trigger.eq(self.ctrl.wrap),
 				self.ctrl.have_in.eq(~self.enc.n),
 				self.ctrl.have_out.eq(out_fifo.readable),
 
@@ -174,19 +352,29 @@ class Master(Module, AutoCSR):
 				self._in_data.status.eq(in_fifo.dout.data),
 				in_fifo.re.eq(self._in_next.re | wb_in_next),
 				in_fifo.flush.eq(self._in_flush.re),
+				self._in_level.status.eq(in_fifo.level),
 
 				out_fifo.din.time.eq(self._out_time.storage),
 				out_fifo.din.addr.eq(self._out_addr.storage),
 				out_fifo.din.data.eq(self._out_data.storage),
 				out_fifo.we.eq(self._out_next.re | wb_out_next),
 				out_fifo.flush.eq(self._out_flush.re),
+				self._out_level.status.eq(out_fifo.level),
 				]
 
 		# din dout strobing
 		self.comb += [
+				If(self.ctrl.fine,
+					now.eq(self.ctrl.cycle << 3),
+					at.eq(out_fifo.dout.time[3:] << 3),
+					phase.eq(out_fifo.dout.time[:3]),
+				).Else(
+					now.eq(self.ctrl.cycle),
+					at.eq(out_fifo.dout.time),
+				),
 				# TODO: 0 <= diff <= plausibility range
 				out_request.eq(out_fifo.readable & self.ctrl.run &
-					(self.ctrl.cycle == out_fifo.dout.time)),
+					(now == at)),
 				# ignore in_fifo.writable
 				in_request.eq(~self.enc.n & self.ctrl.run),
 				self.busy.eq(out_request | in_request),
@@ -195,6 +383,7 @@ class Master(Module, AutoCSR):
 		# to slaves
 		addrs = []
 		datas = []
+		phases = []
 		stbs = []
 		acks = []
 		for i, (slave, prefix, mask) in enumerate(slaves):
@@ -209,20 +398,90 @@ class Master(Module, AutoCSR):
 			acks.append(sel & source.ack)
 			addrs.append(prefix | (sink.payload.addr & (~mask & 0xffffffff)))
 			datas.append(sink.payload.data)
+			phases.append(sink.payload.phase)
 			stbs.append(sink.stb)
+			if slave is not self.ctrl:
+				self.comb += slave.fine.eq(self.ctrl.fine)
 			self.comb += [
 					sel.eq(out_fifo.dout.addr & mask == prefix),
 					source.payload.addr.eq(out_fifo.dout.addr),
 					source.payload.data.eq(out_fifo.dout.data),
+					source.payload.phase.eq(phase),
 					source.stb.eq(sel & out_request),
 					sink.ack.eq((self.enc.o == i) & in_request),
 					]
 		self.comb += out_fifo.re.eq(out_request & optree("|", acks))
 
+		# performance counters
+		late = Signal()
+		diff = Signal(time_width)
+		in_conflict = Signal()
+		self.comb += [
+				diff.eq(now - at),
+				# head past its time, within wrap plausibility
+				late.eq(out_fifo.readable & self.ctrl.run &
+					(diff != 0) & (diff[-2:] == 0)),
+				in_conflict.eq(in_request & optree("|", [
+					stbs[i] & optree("|", stbs[:i])
+					for i in range(1, len(stbs))])),
+				]
+		counters = [
+				(self._ack_stalls, out_request & ~out_fifo.re),
+				(self._late, late),
+				(self._in_conflicts, in_conflict),
+				(self._out_drops, out_fifo.we & ~out_fifo.writable),
+				(self._in_drops, in_fifo.we & ~in_fifo.writable),
+				]
+		for i, ack in enumerate(acks):
+			dispatched = CSRStatus(32, name="dispatched{}".format(i))
+			setattr(self, "_dispatched{}".format(i), dispatched)
+			counters.append((dispatched, out_request & ack))
+		for csr, inc in counters:
+			count = Signal(32)
+			self.sync += [
+					If(self._counters_clear.re,
+						count.eq(0),
+					).Elif(inc,
+						count.eq(count + 1),
+					),
+					If(self._counters_snapshot.re,
+						csr.status.eq(count),
+					),
+					]
+		for csr, fifo in (self._out_high, out_fifo), (self._in_high, in_fifo):
+			high = Signal(flen(csr.status))
+			self.sync += [
+					If(self._counters_clear.re,
+						high.eq(0),
+					).Elif(fifo.level > high,
+						high.eq(fifo.level),
+					),
+					If(self._counters_snapshot.re,
+						csr.status.eq(high),
+					),
+					]
+
+		if trace_depth:
+			self.submodules.trace = trace = Trace(trace_depth)
+			self.comb += [
+					trace.cycle.eq(self.ctrl.cycle),
+					trace.run.eq(self.ctrl.run),
+					trace.late.eq(late),
+					trace.out.stb.eq(out_fifo.re),
+					trace.out.din.time.eq(out_fifo.dout.time),
+					trace.out.din.addr.eq(out_fifo.dout.addr),
+					trace.out.din.data.eq(out_fifo.dout.data),
+					trace.inp.stb.eq(in_fifo.we),
+					trace.inp.din.time.eq(in_fifo.din.time),
+					trace.inp.din.addr.eq(in_fifo.din.addr),
+					trace.inp.din.data.eq(in_fifo.din.data),
+					]
+
 		# from slaves
 		self.comb += [
 				self.enc.i.eq(Cat(stbs)),
-				in_fifo.din.time.eq(self.ctrl.cycle),
+				in_fifo.din.time.eq(now |
+					Mux(self.ctrl.fine, Array(phases)[self.enc.o], 0)),
 				in_fifo.din.addr.eq(Array(addrs)[self.enc.o]),
 				in_fifo.din.data.eq(Array(datas)[self.enc.o]),
 				in_fifo.we.eq(in_request),
@@ -250,6 +509,8 @@ class Master(Module, AutoCSR):
 							0x2: bus.dat_r.eq(in_fifo.dout.time),
 							0x3: bus.dat_r.eq(in_fifo.dout.addr),
 							0x4: bus.dat_r.eq(in_fifo.dout.data),
+							0xa: bus.dat_r.eq(out_fifo.level),
+							0xb: bus.dat_r.eq(in_fifo.level),
 						}),
 					)]
 			self.sync += bus.ack.eq(bus.cyc & bus.stb & ~bus.ack)
@@ -3,7 +3,7 @@
 from migen.fhdl.std import *
 from migen.bus import wishbone, csr
 from migen.bus.transactions import *
-from migen.sim.generic import run_simulation
+from migen.sim.generic import run_simulation, StopSimulation
 from migen.bank import csrgen
 
 from gateware.ventilator import Master, Loopback, Gpio, Wishbone
@@ -131,7 +131,203 @@ class _TB(Module):
 				self.wb.bus, self.wbtg.bus)
 
 
+class _WaitTarget(wishbone.TargetModel):
+	"""Acks after `wait` wait states, counts the completed writes."""
+	def __init__(self, wait=0):
+		self.wait = wait
+		self.n = 0
+		self.writes = 0
+
+	def can_ack(self, bus):
+		if self.n < self.wait:
+			self.n += 1
+			return False
+		self.n = 0
+		return True
+
+	def write(self, address, data, sel):
+		self.writes += 1
+
+
+_bench_slaves = {
+	# name: (prefix, mask, event address, data(k))
+	"gpio": (0x00000100, 0xffffff00, 0x00000101, lambda k: 0xf*(k & 1)),
+	"loopback": (0x00000200, 0xffffff00, 0x00000200, lambda k: k),
+	"wb": (0x20000000, 0xe0000000, 0x3f000000, lambda k: k),
+}
+
+
+class _BenchTB(Module):
+	"""Synthetic load through the wishbone port, like the CPU would.
+
+	Writes `n` events `interval` cycles apart, round-robin over the
+	slaves in `mix`, the first `slack` cycles after the start and as
+	many ahead of the start as fit. With `drain`, reads an input
+	event (if any) after each push. Gpio outputs are looped back to
+	rising edge detecting inputs.
+	"""
+	def __init__(self, depth=64, mix=("gpio",), interval=4, wait=0,
+			n=None, slack=64, drain=True):
+		self.depth = depth
+		self.mix = mix
+		slaves = []
+		if "gpio" in mix:
+			pads = Signal(8)
+			self.submodules.gp = Gpio(pads)
+			self.comb += pads[4:].eq(pads[:4])
+		if "loopback" in mix:
+			self.submodules.lb = Loopback()
+		self.target = _WaitTarget(wait)
+		if "wb" in mix:
+			self.submodules.wb = Wishbone()
+			self.submodules.wbtg = wishbone.Target(self.target)
+			self.submodules.wbic = wishbone.InterconnectPointToPoint(
+					self.wb.bus, self.wbtg.bus)
+		for name, slave in [("gpio", "gp"), ("loopback", "lb"), ("wb", "wb")]:
+			if name in mix:
+				prefix, mask = _bench_slaves[name][:2]
+				slaves.append((getattr(self, slave), prefix, mask))
+		self.submodules.dut = Master(slaves, depth=depth)
+
+		events = []
+		if "gpio" in mix:
+			events += [(1, 0x00000102, 0x0f), (2, 0x00000103, 0xf0)]
+		n = 4*depth if n is None else n
+		for k in range(n):
+			addr, data = _bench_slaves[mix[k % len(mix)]][2:]
+			events.append((slack + k*interval, addr, data(k//len(mix))))
+		self.n = len(events)
+		self.wb_events = sum(1 for ev in events
+				if ev[1] == _bench_slaves["wb"][2])
+
+		self.start = False
+		self.done = False
+		self.popped = 0
+		self.submodules.ini = wishbone.Initiator(self._gen(events, drain))
+		self.submodules.con = wishbone.InterconnectPointToPoint(
+				self.ini.bus, self.dut.bus)
+
+		self.cycles = 0
+		self.dispatched = 0
+		self.stalls = 0
+		self.late = 0
+		self.in_events = 0
+		self.in_drops = 0
+		self.out_drops = 0
+		self.out_high = 0
+		self.in_high = 0
+
+	def _gen(self, events, drain):
+		for i, (time, addr, data) in enumerate(events):
+			while True:
+				t = TRead(0xa) # out level
+				yield t
+				if t.data < self.depth:
+					break
+				self.start = True
+			yield TWrite(0x6, time)
+			yield TWrite(0x7, addr)
+			yield TWrite(0x8, data)
+			yield TWrite(0x9, 0) # out next
+			if i == self.depth - 1:
+				self.start = True
+			if drain:
+				t = TRead(0xb) # in level
+				yield t
+				if t.data:
+					for adr in 0x2, 0x3, 0x4:
+						yield TRead(adr)
+					yield TWrite(0x5, 0) # in next
+					self.popped += 1
+		self.start = True
+		self.done = True
+
+	def do_simulation(self, selfp):
+		d = selfp.dut
+		if self.start and not d.ctrl.run:
+			d.ctrl._start.re = 1
+			return
+		d.ctrl._start.re = 0
+		if not d.ctrl.run:
+			return
+		self.cycles += 1
+		out_re = d.out_fifo.re
+		self.dispatched += out_re
+		head = d.out_fifo.readable
+		diff = (d.ctrl.cycle - d.out_fifo.dout.time) & 0xffffffff
+		self.stalls += head and diff == 0 and not out_re
+		self.late += head and 0 < diff < (1 << 30)
+		in_we = d.in_fifo.we
+		self.in_events += in_we and d.in_fifo.writable
+		self.in_drops += in_we and not d.in_fifo.writable
+		self.out_drops += d.out_fifo.we and not d.out_fifo.writable
+		self.out_high = max(self.out_high, d.out_fifo.level)
+		self.in_high = max(self.in_high, d.in_fifo.level)
+		if self.done and not head:
+			raise StopSimulation
+
+	def report(self):
+		return dict(cycles=self.cycles, events=self.n,
+				dispatched=self.dispatched,
+				events_per_cycle=self.dispatched/max(self.cycles, 1),
+				stalls=self.stalls, late=self.late,
+				stuck=self.n - self.dispatched,
+				wb_lost=self.wb_events - self.target.writes
+					if "wb" in self.mix else 0,
+				in_events=self.in_events, popped=self.popped,
+				in_drops=self.in_drops, out_drops=self.out_drops,
+				out_high=self.out_high, in_high=self.in_high)
+
+
+def bench(depth=64, mix=("gpio",), interval=4, wait=0, n=None, slack=64,
+		drain=True, ncycles=None):
+	tb = _BenchTB(depth, mix, interval, wait, n, slack, drain)
+	if ncycles is None:
+		ncycles = 64*tb.n*max(interval, 1) + 10000
+	run_simulation(tb, ncycles=ncycles)
+	return tb.report()
+
+
+def main():
+	import argparse
+	import itertools
+	p = argparse.ArgumentParser(description="Master throughput benchmark "
+			"(headless simulation). Sweeps all combinations.")
+	p.add_argument("-d", "--depth", type=int, nargs="+", default=[16, 256])
+	p.add_argument("-m", "--mix", nargs="+",
+			default=["gpio", "loopback", "gpio,wb", "gpio,loopback,wb"],
+			help="comma separated slaves out of " +
+			", ".join(sorted(_bench_slaves)))
+	p.add_argument("-i", "--interval", type=int, nargs="+", default=[1, 4, 16],
+			help="cycles between events")
+	p.add_argument("-w", "--wait", type=int, nargs="+", default=[0, 2],
+			help="wishbone target wait states")
+	p.add_argument("-n", "--events", type=int, default=None,
+			help="events per run [default: 4*depth]")
+	p.add_argument("-s", "--slack", type=int, default=64,
+			help="cycles from start to the first event")
+	p.add_argument("--no-drain", action="store_true",
+			help="do not read the input FIFO")
+	p.add_argument("--smoke", action="store_true",
+			help="run the functional test instead")
+	args = p.parse_args()
+
+	if args.smoke:
+		run_simulation(_TB(), vcd_name="ventilator.vcd", ncycles=1000)
+		return
+
+	for depth, mix, interval, wait in itertools.product(args.depth,
+			args.mix, args.interval, args.wait):
+		mix = tuple(mix.split(","))
+		if wait and "wb" not in mix:
+			continue
+		r = bench(depth, mix, interval, wait, args.events, args.slack,
+				not args.no_drain)
+		print(" ".join(["depth={}".format(depth), "mix={}".format("+".join(mix)),
+			"interval={}".format(interval), "wait={}".format(wait)] +
+			["{}={:.3g}".format(k, v) if isinstance(v, float)
+				else "{}={}".format(k, v) for k, v in sorted(r.items())]))
+
+
 if __name__ == "__main__":
-	from migen.fhdl import verilog
-	#print(verilog.convert(_TB()))
-	run_simulation(_TB(), vcd_name="ventilator.vcd", ncycles=1000)
+	main()
@@ -9,13 +9,15 @@ ventilator_layout = [
 		("addr", 32),
 		("data", 32),
 		]
-slave_layout = ventilator_layout[1:]
+# phase: 1/8 cycle sub-time in fine time mode, 0 otherwise
+slave_layout = ventilator_layout[1:] + [("phase", 3)]
 
 class Slave(Module):
 	def __init__(self):
 		self.dout = Sink(slave_layout)
 		self.din = Source(slave_layout)
 		self.busy = Signal()
+		self.fine = Signal()
 
 class Loopback(Slave):
 	def __init__(self):
@@ -9,51 +9,139 @@
 #define DDS_BDD 1
 #define DETECTS 1
 #define DETECT_MASK 0xff
-#define HISTS 20
+#define HISTS 20 /* default, see PARAM_N_HISTS */
+#define MAX_HISTS (DETECT_MASK + 1)
 #define HISTOGRAM_ADDR 0x01000000
-#define PARAMS 2
+#define PARAMS 8
 #define PARAM_ADDR 0x00000000
 #define PARAM_N_RUNS 0
 #define PARAM_N_REPEATS 1
+#define PARAM_SPARSE 2
+#define PARAM_N_HISTS 3
+#define PARAM_FTW0 4 /* DDS tuning words, 3 tunes */
+#define PARAM_DETECT_END 7 /* helper time, before the end marker */
 
-static void push_events(void)
+#define FREQ0 100e6
+#define FREQ1 200e6
+#define FREQ2 300e6
+#define DETECT_END_US 38.2
+
+#define PULSES_US(t) \
+	seq_gpio_us(t, AO_BD), seq_gpio_us((t) + .1, 0), \
+	seq_gpio_us((t) + .2, AO_BD), seq_gpio_us((t) + .4, 0)
+
+static const ventilator_event_t seq_init[] = {
+	seq_fine_time(), /* held since SETUP or the previous run */
+	seq_event(0, VENTILATOR_CTRL_CLEAR_FORCE, 0), /* 0, 0, 1,... */
+	seq_dds_tune_us(35., DDS_BD, FREQ0, 0),
+	seq_dds_tune_us(35.2, DDS_BD, FREQ1, .11),
+	seq_dds_tune_us(35.4, DDS_BD, FREQ2, .22),
+	seq_sense_us(35.6, PMT0 | AO_BD),
+	PULSES_US(35.7),
+	PULSES_US(36.2),
+	PULSES_US(36.7),
+	PULSES_US(37.2),
+	PULSES_US(37.7),
+	seq_sense_us(DETECT_END_US, 0),
+	seq_loopback_us(38.3, 0xdead), /* detection end marker */
+	seq_event_us(100., VENTILATOR_CTRL_CLEAR_FORCE, 1), /* n, n+1, 0,... */
+};
+#define SEQ_TUNE(k) (2 + 8*(k))
+#define SEQ_DETECT_END 47
+
+/* the indices patches[] relies on */
+#define SEQ_LEN(...) \
+	(sizeof((ventilator_event_t[]){__VA_ARGS__})/sizeof(ventilator_event_t))
+_Static_assert(SEQ_TUNE(0) == SEQ_LEN(seq_fine_time(),
+			seq_event(0, VENTILATOR_CTRL_CLEAR_FORCE, 0)), "SEQ_TUNE(0)");
+_Static_assert(SEQ_TUNE(1) - SEQ_TUNE(0) == SEQ_LEN(seq_dds_tune(0, 0, 0, 0)),
+		"SEQ_TUNE() stride");
+_Static_assert(SEQ_DETECT_END == SEQ_TUNE(3) + SEQ_LEN(seq_sense_us(0, 0)) +
+		5*SEQ_LEN(PULSES_US(0)), "SEQ_DETECT_END");
+_Static_assert(len(seq_init) == SEQ_DETECT_END + 3, "seq_init length");
+
+/* seq_init with the parameters applied, replayed for each run */
+static ventilator_event_t seq[len(seq_init)];
+
+/*
+ * Where the parameters go: shift < 0 sets the time of seq[ev],
+ * otherwise the data is set to the parameter >> shift.
+ */
+typedef struct patch_t {
+	uint8_t param;
+	uint8_t ev;
+	int8_t shift;
+} patch_t;
+
+#define PATCH_FTW(k) \
+	{PARAM_FTW0 + (k), SEQ_TUNE(k) + 1, 24}, \
+	{PARAM_FTW0 + (k), SEQ_TUNE(k) + 2, 16}, \
+	{PARAM_FTW0 + (k), SEQ_TUNE(k) + 3, 8}, \
+	{PARAM_FTW0 + (k), SEQ_TUNE(k) + 4, 0}
+
+static const patch_t patches[] = {
+	PATCH_FTW(0),
+	PATCH_FTW(1),
+	PATCH_FTW(2),
+	{PARAM_DETECT_END, SEQ_DETECT_END, -1},
+};
+
+static uint32_t param[PARAMS];
+
+/*
+ * PARAM_DETECT_END has to stay at least a cycle after the last pulse
+ * and before the end marker, or the sequence is out of order.
+ */
+static int param_ok(unsigned int p, uint32_t v)
 {
-	/* TODO: this will deadlock when the output FIFO gets filled */
-	int i;
-	gpio_start()
-	irq_setie(0);
-	ventilator->push1(now_cycles(), VENTILATOR_CTRL_CLEAR_FORCE, 0, 0); /* 0, 0, 1,... */
-	wait_us(35.)
-	dds_tune(DDS_BD, 100e6, 0)
-	dds_tune(DDS_BD, 200e6, .11)
-	dds_tune(DDS_BD, 300e6, .22)
-	gpio_open(PMT0 | AO_BD)
-	wait_us(.1)
-	for (i=0; i<5; i++) {
-		gpio_pulse_us(.1, AO_BD)
-		wait_us(.1)
-		gpio_pulse_us(.2, AO_BD)
-		wait_us(.1)
+	if (p == PARAM_N_HISTS)
+		return (v > 0) && (v <= MAX_HISTS);
+	if (p == PARAM_DETECT_END)
+		return (v >= seq[SEQ_DETECT_END - 1].time + cycles_to_time(1)) &&
+			(v <= seq[SEQ_DETECT_END + 1].time - cycles_to_time(1));
+	return 1;
+}
+
+/* Only touches the events that depend on param[p] */
+static void patch_seq(unsigned int p)
+{
+	unsigned int i;
+	for (i=0; i<len(patches); i++) {
+		if (patches[i].param != p)
+			continue;
+		if (patches[i].shift < 0)
+			seq[patches[i].ev].time = param[p];
+		else
+			seq[patches[i].ev].data = param[p] >> patches[i].shift;
 	}
-	gpio_close(PMT0 | AO_BD)
-	loopback(0xdead) /* detection end marker */
-	at_us(100.)
-	ventilator->push1(now_cycles(), VENTILATOR_CTRL_CLEAR_FORCE, 1, 0); /* n, n+1, 0,... */
-	irq_setie(1);
+}
+
+/*
+ * Resumed from poll() while the output FIFO is full. The ISR only
+ * reads the input FIFO, no need to disable interrupts.
+ */
+static ventilator_pt_t pt_events;
+static int push_events(ventilator_pt_t *pt)
+{
+	static unsigned int i;
+	pt_begin(pt)
+	i = 0;
+	pt_wait_until(pt, ventilator_reg_push_seq_part(seq, len(seq), 0, &i))
+	pt_end(pt)
 }
 
 static volatile uint32_t detect[DETECTS];
 static volatile int done = 0;
-static void count_rises(void)
+static void VENTILATOR_FAST count_rises(void)
 {
 	if (ventilator->pop_count(VENTILATOR_GPIO_IN_RISE, DETECT_MASK,
 					(uint32_t *) &detect[done], 1)) {
-		ventilator->pop(0, 0); /* loopback 0xdead marker */
+		ventilator_reg_pop(0, 0); /* loopback 0xdead marker */
 		done++;
 	}
 }
 
-static uint32_t isr(uint32_t pending)
+static uint32_t VENTILATOR_FAST isr(uint32_t pending)
 {
 	if (likely(pending & VENTILATOR_EV_IN_READABLE))
 		count_rises();
@@ -63,25 +151,29 @@ static uint32_t isr(uint32_t pending)
 static void send_histograms(uint32_t *hist, int n)
 {
 	ventilator_msg_t ret;
-	ventilator->send_array(&ret, 0, HISTOGRAM_ADDR, hist, n);
+	if (param[PARAM_SPARSE])
+		ventilator->send_sparse(&ret, 0, HISTOGRAM_ADDR, hist, n);
+	else
+		ventilator->send_array(&ret, 0, HISTOGRAM_ADDR, hist, n);
 	ret.type = VENTILATOR_MSG_DONE;
 	ret.len = 0;
 	ventilator->send(&ret);
 }
 
-static uint32_t param[PARAMS];
 static int trigger = 0;
-static uint32_t hist[DETECTS*HISTS];
+/* DETECTS*MAX_HISTS, allocated on the first ARM after SETUP */
+static uint32_t *hist = 0;
 static void poll(void)
 {
 	static uint32_t runs = 0;
 	static uint32_t repeats = 0;
-	int i;
+	uint32_t hists = param[PARAM_N_HISTS];
+	unsigned int i;
 	if (done == DETECTS) {
 		done = 0;
 		runs++;
 		for (i=0; i<DETECTS; i++) {
-			hist[i*HISTS + min(detect[i], HISTS - 1)]++;
+			hist[i*hists + min(detect[i], hists - 1)]++;
 			detect[i] = 0;
 		}
 		if (runs < param[PARAM_N_RUNS]
@@ -90,8 +182,8 @@ static void poll(void)
 		} else {
 			runs = 0;
 			repeats++;
-			send_histograms(hist, DETECTS*HISTS);
-			for (i=0; i<DETECTS*HISTS; i++)
+			send_histograms(hist, DETECTS*hists);
+			for (i=0; i<DETECTS*hists; i++)
 				hist[i] = 0;
 			if ((repeats < param[PARAM_N_REPEATS])
 				|| (!param[PARAM_N_REPEATS])) {
@@ -101,15 +193,13 @@ static void poll(void)
 			}
 		}
 	}
-	if (trigger) {
+	if (trigger && (push_events(&pt_events) == PT_DONE))
 		trigger = 0;
-		push_events();
-	}
 }
 
 static void handle_msg(ventilator_msg_t *msg)
 {
-	unsigned int i;
+	unsigned int i, j;
 	static const ventilator_event_t ev_setup[8] = {
 		{0, VENTILATOR_CTRL_CLEAR_FORCE, 1},
 		{0, VENTILATOR_GPIO_SENSE_RISE, 0x000000},
@@ -123,39 +213,78 @@ static void handle_msg(ventilator_msg_t *msg)
 	};
 	switch (msg->type) {
 		case VENTILATOR_MSG_SETUP:
-			for (i=0; i<HISTS*DETECTS; i++)
-				hist[i] = 0;
+			trigger = 0;
+			pt_init(&pt_events)
+			hist = 0;
 			for (i=0; i<DETECTS; i++)
 				detect[i] = 0;
 			param[PARAM_N_RUNS] = 100;
 			param[PARAM_N_REPEATS] = 1;
+			param[PARAM_SPARSE] = 0;
+			param[PARAM_N_HISTS] = HISTS;
+			param[PARAM_FTW0] = dds_ftw(FREQ0);
+			param[PARAM_FTW0 + 1] = dds_ftw(FREQ1);
+			param[PARAM_FTW0 + 2] = dds_ftw(FREQ2);
+			param[PARAM_DETECT_END] = us_to_time(DETECT_END_US);
+			for (i=0; i<len(seq); i++)
+				seq[i] = seq_init[i];
 			ventilator->stop();
 			ventilator->push_many(ev_setup, len(ev_setup), 0);
 			ventilator->start();
 			ventilator->pop(0, 0);
 			ventilator->stop();
-			ventilator->set_callbacks(&ventilator_kernel, &isr,
-					VENTILATOR_EV_IN_READABLE);
+			if (!ventilator->set_callbacks(&ventilator_kernel, &isr,
+						VENTILATOR_EV_IN_READABLE))
+				msg->status = VENTILATOR_MSG_NACK;
 			break;
 		case VENTILATOR_MSG_UPDATE:
 			for (i=0; msg->len>i*sizeof(ventilator_event_t); i++) {
-				if (msg->ev[i].addr >= PARAMS) {
+				if ((msg->ev[i].addr >= PARAMS) ||
+						!param_ok(msg->ev[i].addr, msg->ev[i].data)) {
 					msg->status = VENTILATOR_MSG_NACK;
 					break;
 				}
+				if (msg->ev[i].data == param[msg->ev[i].addr])
+					continue;
+				if (msg->ev[i].addr == PARAM_N_HISTS) {
+					/* the runs in flight use the old layout */
+					trigger = 0;
+					pt_init(&pt_events)
+					ventilator->stop();
+					done = 0;
+					for (j=0; j<DETECTS; j++)
+						detect[j] = 0;
+					if (hist)
+						for (j=0; j<DETECTS*MAX_HISTS; j++)
+							hist[j] = 0;
+				}
 				param[msg->ev[i].addr - PARAM_ADDR] = msg->ev[i].data;
+				patch_seq(msg->ev[i].addr);
 			}
 			break;
 		case VENTILATOR_MSG_ARM:
+			if (!hist) {
+				hist = ventilator->alloc(DETECTS*MAX_HISTS*sizeof(*hist));
+				if (!hist) {
+					msg->status = VENTILATOR_MSG_NACK;
+					break;
+				}
+				for (i=0; i<DETECTS*MAX_HISTS; i++)
+					hist[i] = 0;
+			}
 			trigger = 1;
 			break;
 		case VENTILATOR_MSG_TRIGGER:
 			ventilator->start();
 			break;
 		case VENTILATOR_MSG_ABORT:
+			trigger = 0;
+			pt_init(&pt_events)
 			ventilator->stop();
 			break;
 		case VENTILATOR_MSG_CLEANUP:
+			trigger = 0;
+			pt_init(&pt_events)
 			ventilator->stop();
 			ventilator->set_callbacks(0, 0, 0);
 			break;
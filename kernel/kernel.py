@@ -2,13 +2,16 @@
 # Robert Jordens <jordens@gmail.com>, 2014
 
 import os
+import zlib
 import struct
+import hashlib
 import asyncio
 import logging
 import termios
 from enum import Enum
 from tempfile import mkstemp
-from collections import namedtuple
+from itertools import islice
+from collections import namedtuple, deque
 
 logger = logging.getLogger("ventilator")
 
@@ -22,8 +25,21 @@ class MsgType(Enum):
 	STATUS = 0x13
 	START = 0x14
 	STOP = 0x15
+	LOADZ = 0x16
+	BOOT = 0x17
 	PUSH = 0x18
 	POP = 0x19
+	HASH = 0x1a
+	ACTIVATE = 0x1b
+	PERSIST = 0x1c
+	BENCH = 0x1d
+	TRACE = 0x1e
+	PROFILE = 0x1f
+	SUBSCRIBE = 0x30
+	EVENTS = 0x31
+	DICT = 0x32
+	PUSH_PACKED = 0x33
+	SPARSE = 0x34
 	SETUP = 0x20
 	UPDATE = 0x21
 	ARM = 0x22
@@ -43,6 +59,131 @@ _magic = b"\xa5"
 _Msg = struct.Struct(">cBBB")
 _Event = struct.Struct(">III")
 Event = namedtuple("Event", "time addr data")
+TraceEvent = namedtuple("TraceEvent", "cycle time addr data")
+
+_sdram_base = 0x40000000
+_header = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+		os.pardir, "software", "ventilator.h")
+
+def _define(name, header=_header):
+	"""The integer value of a #define in the firmware header."""
+	with open(header) as f:
+		for line in f:
+			w = line.split()
+			if w[:2] == ["#define", name]:
+				return int(w[2], 0)
+	raise KeyError(name)
+
+_abi_version = _define("VENTILATOR_ABI_VERSION")
+
+_max_len = 255
+_max_events = _max_len//_Event.size
+
+
+_counters = {
+	0x01: "out_high",
+	0x02: "in_high",
+	0x03: "ack_stalls",
+	0x04: "late",
+	0x05: "in_conflicts",
+	0x06: "out_drops",
+	0x07: "in_drops",
+}
+_counter_dispatched = 0x10
+
+_bench_tests = ["push1_csr", "push1_wb", "push1", "push_many", "pop_csr",
+	"pop_wb", "pop_many", "isr", "recv", "send_array"]
+_sys_clk = 80e6
+
+_profile_hooks = ["isr", "kernel_isr", "poll", "handle"]
+_profile_bins = 8
+Profile = namedtuple("Profile", "count total max hist")
+
+_trace_arm = 0x01
+_trace_stop = 0x02
+_trace_state = 0x03
+_trace_out = 0x04
+_trace_in = 0x05
+_trace_sources = {"out": 0x01, "in": 0x02, "late": 0x04, "stop": 0x08}
+_trace_armed = 0x01
+_trace_triggered = 0x02
+
+
+_packed_index = 0x1f
+_packed_addr = 0x20
+_packed_data = 0x40
+
+
+def _pack_varint(v):
+	b = bytearray()
+	while v >= 0x80:
+		b.append(v & 0x7f | 0x80)
+		v >>= 7
+	b.append(v)
+	return bytes(b)
+
+
+def _lz_tokens(data, window=0xffff, max_match=0x7f + 3,
+		max_literal=0x80, chain=16):
+	"""Greedy LZ77 for LOADZ. Yields (token, output length)."""
+	table = {}
+	i = literal = 0
+
+	def literals(end):
+		for j in range(literal, end, max_literal):
+			n = min(max_literal, end - j)
+			yield bytes([n - 1]) + data[j:j + n], n
+
+	while i < len(data):
+		key = data[i:i + 3]
+		n = off = 0
+		positions = table.setdefault(key, [])
+		for j in reversed(positions[-chain:]):
+			if i - j > window:
+				break
+			m = 0
+			while (m < max_match and i + m < len(data)
+					and data[j + m] == data[i + m]):
+				m += 1
+			if m > n:
+				n, off = m, i - j
+		positions.append(i)
+		if n < 3:
+			i += 1
+			continue
+		yield from literals(i)
+		yield bytes([0x80 | (n - 3)]) + struct.pack(">H", off), n
+		for j in range(i + 1, i + n):
+			table.setdefault(data[j:j + 3], []).append(j)
+		i = literal = i + n
+	yield from literals(i)
+
+
+def _lz_frames(data, address, size=_max_len - 4):
+	"""Group LZ tokens into LOADZ frames of (address, tokens)."""
+	frame = []
+	length = pos = produced = 0
+	for token, n in _lz_tokens(data):
+		if length + len(token) > size:
+			yield address + pos, b"".join(frame)
+			pos += produced
+			frame = []
+			length = produced = 0
+		frame.append(token)
+		length += len(token)
+		produced += n
+	if frame:
+		yield address + pos, b"".join(frame)
+
+
+def _unpack_varints(data):
+	v = s = 0
+	for c in data:
+		v |= (c & 0x7f) << s
+		s += 7
+		if not c & 0x80:
+			yield v
+			v = s = 0
 
 
 class Ventilator:
@@ -59,11 +200,22 @@ class Ventilator:
 		-Wl,-L../misoc/software/include -Tkernel/kernel.ld
 		-Wl,-N -Wl,--gc-section -Wl,--oformat=binary""".split()
 	crt0 = "kernel/crt0.S"
+	cache = os.path.join(os.environ.get("XDG_CACHE_HOME",
+		os.path.expanduser("~/.cache")), "ventilator")
 
-	def __init__(self, port, speed=115200):
+	def __init__(self, port, speed=115200, emulator=False):
 		self.loop = asyncio.get_event_loop()
+		self.addr_dict = {}
+		self.events = deque()
+		self.emulator = emulator
 		self._open(port, speed)
 
+	def pack(self, fmt, *v):
+		return struct.pack(">" + fmt, *v)
+
+	def unpack(self, fmt, data):
+		return struct.unpack(">" + fmt, data)
+
 	def _open(self, port, speed):
 		self._fd = os.open(port, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
 		self.port = os.fdopen(self._fd, "r+b", buffering=0)
@@ -97,11 +249,20 @@ class Ventilator:
 		self.writer.close()
 		self.port.close()
 
+	def options(self, address=None):
+		"""Compiler options, linking the kernel for `address`."""
+		opt = list(self.compile_opt)
+		if address is not None:
+			opt.append("-Wl,--defsym=kernel_offset=0x{:x}".format(
+				address - _sdram_base))
+		return opt
+
 	@asyncio.coroutine
-	def compile(self, *files):
+	def compile(self, *files, address=None):
 		fd, temp = mkstemp()
 		proc = yield from asyncio.create_subprocess_exec(
-				*(self.compile_opt + ["-o", temp, self.crt0] + list(files)))
+				*(self.options(address) + ["-o", temp, self.crt0] +
+					list(files)))
 		exit = yield from asyncio.wait_for(proc.wait(), timeout=None)
 		kernel = os.fdopen(fd, "rb").read()
 		try:
@@ -112,12 +273,106 @@ class Ventilator:
 			raise ValueError("compilation failed ({})".format(exit))
 		return kernel
 
+	@asyncio.coroutine
+	def depends(self, *files, address=None):
+		proc = yield from asyncio.create_subprocess_exec(
+				*(self.options(address) + ["-M", self.crt0] + list(files)),
+				stdout=asyncio.subprocess.PIPE)
+		out, _ = yield from proc.communicate()
+		if proc.returncode:
+			raise ValueError("dependency scan failed ({})".format(
+				proc.returncode))
+		deps = set(out.decode().replace("\\\n", " ").split())
+		deps.update(o[2:] for o in self.compile_opt if o.startswith("-T"))
+		return sorted(d for d in deps if not d.endswith(":"))
+
+	@asyncio.coroutine
+	def compile_cached(self, *files, address=None):
+		"""Like `compile()` but reuses a previous image if the options,
+		the sources and everything they depend on are unchanged."""
+		h = hashlib.sha256()
+		h.update(" ".join(self.options(address)).encode())
+		for dep in (yield from self.depends(*files, address=address)):
+			h.update(dep.encode())
+			with open(dep, "rb") as f:
+				h.update(f.read())
+		name = os.path.join(self.cache, h.hexdigest() + ".bin")
+		try:
+			with open(name, "rb") as f:
+				kernel = f.read()
+			logger.info("compile cache hit %s", name)
+			return kernel
+		except FileNotFoundError:
+			pass
+		kernel = yield from self.compile(*files, address=address)
+		os.makedirs(self.cache, exist_ok=True)
+		fd, temp = mkstemp(dir=self.cache)
+		with os.fdopen(fd, "wb") as f:
+			f.write(kernel)
+		os.replace(temp, name)
+		return kernel
+
 	def pack_events(self, ev):
-		return b"".join(_Event.pack(*i) for i in ev)
+		return b"".join(self.pack("III", *i) for i in ev)
+
+	def pack_packed(self, ev):
+		"""Compact encoding of the leading events in `ev` that fit into
+		one frame. Returns the frame data and the number of events."""
+		data = []
+		size = 0
+		t = None
+		for n, e in enumerate(ev):
+			if t is None:
+				t = e.time
+				data.append(_pack_varint(t))
+				size += len(data[-1])
+			i = self.addr_dict.get(e.addr)
+			tail = b""
+			if i is None:
+				tag = _packed_addr
+				tail += _pack_varint(e.addr)
+			else:
+				tag = i
+			if e.data:
+				tag |= _packed_data
+				tail += _pack_varint(e.data)
+			chunk = bytes([tag]) + _pack_varint((e.time - t) & 0xffffffff) + tail
+			if size + len(chunk) > _max_len:
+				return b"".join(data), n
+			data.append(chunk)
+			size += len(chunk)
+			t = e.time
+		return b"".join(data), len(ev)
 
 	def unpack_events(self, data):
 		for i in range(0, len(data), _Event.size):
-			yield Event._make(_Event.unpack(data[i:i+_Event.size]))
+			yield Event._make(self.unpack("III", data[i:i+_Event.size]))
+
+	def unpack_stream(self, data):
+		"""Decode an EVENTS frame into (dropped, [Event, ...]) with 64
+		bit times."""
+		v = _unpack_varints(data)
+		dropped = next(v)
+		t = next(v) << 32
+		ev = []
+		for dt, addr, d in zip(v, v, v):
+			t += dt
+			ev.append(Event(time=t, addr=addr, data=d))
+		return dropped, ev
+
+	def unpack_sparse(self, data):
+		"""Decode a SPARSE frame into (time, {addr: value})."""
+		v = _unpack_varints(data)
+		t = next(v)
+		a = next(v)
+		r = {}
+		for zeros in v:
+			r.update((a + i, 0) for i in range(zeros))
+			a += zeros
+			for i in range(next(v)):
+				r[a] = next(v)
+				a += 1
+		return t, r
 
 	def send(self, typ, status=MsgType.NONE, data=b""):
 		assert len(data) < 256, len(data)
@@ -127,6 +382,17 @@ class Ventilator:
 
 	@asyncio.coroutine
 	def recv(self):
+		"""Receive the next frame. Unsolicited EVENTS frames can arrive
+		between a request and its reply, they are queued for
+		`recv_events()`."""
+		while True:
+			typ, status, data = yield from self._recv()
+			if typ != MsgType.EVENTS:
+				return typ, status, data
+			self.events.append(self.unpack_stream(data))
+
+	@asyncio.coroutine
+	def _recv(self):
 		s = yield from self.reader.readexactly(_Msg.size)
 		fail = b""
 		while not s.startswith(_magic):
@@ -162,30 +428,284 @@ class Ventilator:
 		return MsgStatus.NACK, b""
 
 	@asyncio.coroutine
-	def load(self, kernel, address):
-		for pos in range(0, len(kernel), 256 - 8):
-			chunk = kernel[pos:pos+256-8]
-			addr = struct.pack(">I", address + pos)
-			yield from self.req(MsgType.LOAD, data=addr+chunk)
-		yield from self.req(MsgType.LOAD, struct.pack(">I", address))
+	def hash(self, address, length):
+		data = yield from self.req(MsgType.HASH,
+				self.pack("II", address, length))
+		crc, = self.unpack("I", data)
+		return crc
+
+	@asyncio.coroutine
+	def load(self, kernel, address, force=False, compress=True, slot=0,
+			boot=True):
+		crc = zlib.crc32(kernel) & 0xffffffff
+		resident = None
+		if not force:
+			resident = yield from self.hash(address, len(kernel))
+		if resident == crc:
+			logger.info("kernel at 0x%08x unchanged", address)
+		elif compress:
+			for addr, chunk in _lz_frames(kernel, address):
+				yield from self.req(MsgType.LOADZ,
+						data=self.pack("I", addr) + chunk)
+		else:
+			for pos in range(0, len(kernel), 256 - 8):
+				chunk = kernel[pos:pos+256-8]
+				addr = self.pack("I", address + pos)
+				yield from self.req(MsgType.LOAD, data=addr+chunk)
+		if boot:
+			yield from self.req(MsgType.BOOT, self.pack("IIII",
+				address, len(kernel), crc, slot))
 
 	@asyncio.coroutine
-	def kernel(self, sources, address, runs, repeats):
+	def persist(self, kernel, address, params=()):
+		"""Store the kernel and its default parameter UPDATE events in
+		flash to have it restored and set up on boot. The image must
+		be loaded but not yet booted. Without a kernel, clears the
+		flash image."""
+		data = b""
+		if kernel:
+			data = self.pack("III", address, len(kernel),
+				zlib.crc32(kernel) & 0xffffffff) + self.pack_events(params)
+		yield from self.req(MsgType.PERSIST, data)
+
+	@asyncio.coroutine
+	def activate(self, slot):
+		"""Switch to the resident kernel in `slot`. SETUP it next."""
+		yield from self.req(MsgType.ACTIVATE, self.pack("I", slot))
+
+	@asyncio.coroutine
+	def status(self, clear=False):
+		"""Return (cycle, ev_status, counters) where cycle has 64 bits
+		and counters maps the gateware performance counter names to
+		their values. Clears the counters after reading with `clear`."""
+		data = yield from self.req(MsgType.STATUS,
+				self.pack("I", 1) if clear else b"")
+		events = list(self.unpack_events(data))
+		counters = {}
+		for ev in events[1:]:
+			if ev.addr >= _counter_dispatched:
+				name = "dispatched{}".format(ev.addr - _counter_dispatched)
+			else:
+				name = _counters.get(ev.addr, hex(ev.addr))
+			counters[name] = ev.data
+		return (events[0].addr << 32 | events[0].time, events[0].data,
+				counters)
+
+	@asyncio.coroutine
+	def bench(self, test, n):
+		"""Run the firmware benchmark `test` (see `_bench_tests`) over
+		`n` events, words, interrupts or frames. Returns (cpu cycles, n),
+		for "recv" n is the number of bytes timed."""
+		self.send(MsgType.BENCH, MsgStatus.REQ, self.pack("II",
+			_bench_tests.index(test) + 1, n))
+		if test == "recv":
+			for i in range(n):
+				self.send(MsgType.NONE, MsgStatus.NONE, bytes(_max_len))
+		while True:
+			typ, status, data = yield from self.recv()
+			if typ == MsgType.BENCH:
+				break
+		assert status == MsgStatus.ACK, (test, status, data)
+		ev = next(self.unpack_events(data))
+		return ev.time, ev.data
+
+	@asyncio.coroutine
+	def bench_all(self, n=256):
 		yield from self.connect()
-		s = yield from self.req(MsgType.STATUS)
-		logger.info("status %s", list(self.unpack_events(s)))
+		for test in _bench_tests:
+			if test == "recv":
+				cycles, k = yield from self.bench(test, 32)
+			else:
+				cycles, k = yield from self.bench(test, n)
+			logger.info("bench test=%s n=%i cycles=%i per=%i rate=%i",
+					test, k, cycles, cycles//k, k*_sys_clk/cycles)
+
+	@asyncio.coroutine
+	def profile(self, clear=False):
+		"""Return (cpu cycles, profiles) where profiles maps the
+		firmware hooks (see `_profile_hooks`) to their Profile. The
+		histogram bins are powers of four from 64 cycles. Clears the
+		profile after reading with `clear`. Needs a firmware built with
+		VENTILATOR_PROFILE."""
+		data = yield from self.req(MsgType.PROFILE,
+				self.pack("I", 1) if clear else b"")
+		w = self.unpack("%iI" % (len(data)//4), data)
+		n = 4 + _profile_bins
+		profiles = {}
+		for i, hook in enumerate(_profile_hooks):
+			count, low, high, peak, *hist = w[1 + i*n:1 + (i + 1)*n]
+			profiles[hook] = Profile(count, low | high << 32, peak, hist)
+		return w[0], profiles
+
+	@asyncio.coroutine
+	def trace_arm(self, sources=(), addr=0, mask=0, post=0):
+		"""Clear the gateware event trace and record. It triggers on
+		any of `sources` (see `_trace_sources`), "out" and "in" on
+		event addresses with `addr & mask`, and stops `post` cycles
+		with events after the trigger."""
+		yield from self.req(MsgType.TRACE, self.pack("5I", _trace_arm,
+			sum(_trace_sources[s] for s in sources), addr, mask, post))
+
+	@asyncio.coroutine
+	def trace_stop(self):
+		yield from self.req(MsgType.TRACE, self.pack("I", _trace_stop))
+
+	@asyncio.coroutine
+	def trace_read(self):
+		"""Return (state, trigger cycle, out, in): the dispatched output
+		events as TraceEvents and the input Events, oldest first."""
+		data = yield from self.req(MsgType.TRACE,
+				self.pack("I", _trace_state))
+		state, trigger, n_out, n_in = self.unpack("4I", data)
+		out = []
+		while len(out) < n_out:
+			data = yield from self.req(MsgType.TRACE,
+					self.pack("II", _trace_out, len(out)))
+			w = self.unpack("%iI" % (len(data)//4), data)
+			out.extend(TraceEvent(*w[i:i + 4]) for i in range(0, len(w), 4))
+		inp = []
+		while len(inp) < n_in:
+			data = yield from self.req(MsgType.TRACE,
+					self.pack("II", _trace_in, len(inp)))
+			inp.extend(self.unpack_events(data))
+		return state, trigger, out, inp
+
+	@asyncio.coroutine
+	def trace_dump(self):
+		"""Stop the trace and log it, the dispatched events with their
+		lateness."""
+		yield from self.trace_stop()
+		state, trigger, out, inp = yield from self.trace_read()
+		logger.info("trace %s, trigger at %s, %i out, %i in",
+				"armed" if state & _trace_armed else "stopped",
+				trigger if state & _trace_triggered else None,
+				len(out), len(inp))
+		for ev in out:
+			logger.info("out %10i %#010x %#010x late %i", ev.cycle,
+					ev.addr, ev.data, ev.cycle - ev.time)
+		for ev in inp:
+			logger.info("in  %10i %#010x %#010x", ev.time, ev.addr, ev.data)
+
+	@asyncio.coroutine
+	def push(self, events=()):
+		data = yield from self.req(MsgType.PUSH, self.pack_events(events))
+		credits, n = self.unpack("II", data)
+		return credits
+
+	@asyncio.coroutine
+	def dictionary(self, addrs):
+		"""Set the address dictionary used by the compact encoding."""
+		addrs = list(addrs)
+		assert len(addrs) <= _packed_index + 1, addrs
+		yield from self.req(MsgType.DICT, self.pack("%iI" % (len(addrs) + 1),
+			0, *addrs))
+		self.addr_dict = dict((a, i) for i, a in enumerate(addrs))
+
+	@asyncio.coroutine
+	def stream(self, events, packed=False):
+		"""Push an event sequence of arbitrary length.
+
+		Keeps at most as many events in flight as the firmware has
+		reported free output FIFO slots. Frames are pipelined: the
+		credits in each reply account for all frames up to that one.
+		If a frame does not fit after all (something else pushed),
+		the firmware takes none of the frames behind it. Their events
+		are sent again after an empty PUSH.
+		With `packed`, frames use the compact encoding (see
+		`dictionary()`).
+		"""
+		events = iter(events)
+		pending = deque()
+		inflight = deque()
+		retry = []
+		credits = 0
+		while True:
+			if len(pending) < _max_len and not retry:
+				pending.extend(islice(events, _max_len - len(pending)))
+			n = min(len(pending), credits)
+			if n > 0 and not retry:
+				frame = list(islice(pending, n))
+				if packed:
+					data, n = self.pack_packed(frame)
+					self.send(MsgType.PUSH_PACKED, MsgStatus.REQ, data)
+				else:
+					n = min(n, _max_events)
+					self.send(MsgType.PUSH, MsgStatus.REQ,
+							self.pack_events(frame[:n]))
+				inflight.append(frame[:n])
+				for i in range(n):
+					pending.popleft()
+				credits -= n
+				continue
+			if not pending and not inflight and not retry:
+				break
+			if not inflight:
+				if retry:
+					pending.extendleft(reversed(retry))
+					retry = []
+				self.send(MsgType.PUSH, MsgStatus.REQ)
+				inflight.append([])
+			typ, status, data = yield from self.recv()
+			assert typ in (MsgType.PUSH, MsgType.PUSH_PACKED), (
+					typ, status, data)
+			frame = inflight.popleft()
+			credits, n = self.unpack("II", data)
+			if status != MsgStatus.ACK:
+				assert status == MsgStatus.NACK, (typ, status, data)
+				assert frame, (typ, status, data)
+				retry.extend(frame[n:])
+			credits -= sum(len(f) for f in inflight)
+
+	@asyncio.coroutine
+	def subscribe(self, batch, age):
+		"""Have the firmware send input events unsolicited, flushing
+		after `batch` events or when the oldest is `age` cycles old.
+		`batch=0` unsubscribes."""
+		yield from self.req(MsgType.SUBSCRIBE, self.pack("II", batch, age))
+
+	@asyncio.coroutine
+	def recv_events(self):
+		"""Wait for the next EVENTS frame and return
+		(dropped, [Event, ...])."""
+		while not self.events:
+			typ, status, data = yield from self._recv()
+			if typ == MsgType.EVENTS:
+				self.events.append(self.unpack_stream(data))
+			else:
+				logger.warning("ignoring %s, %s, %s", typ, status, data)
+		return self.events.popleft()
+
+	@asyncio.coroutine
+	def kernel(self, sources, address, runs, repeats, sparse=False, slot=0,
+			flash=False, trace=False, profile=False):
+		yield from self.connect()
+		cycle, status, counters = yield from self.status(clear=True)
+		logger.info("status %#x at %i, %s", status, cycle, counters)
 		self.send(MsgType.STOP)
 		self.send(MsgType.UNLOAD)
 
-		kernel = yield from self.compile(*sources)
-		yield from self.load(kernel, address)
-		yield from self.req(MsgType.SETUP)
-		yield from self.req(MsgType.UPDATE, self.pack_events([
+		params = [
 			Event(time=0, addr=0, data=runs),
 			Event(time=0, addr=1, data=repeats),
-			]))
+			Event(time=0, addr=2, data=int(sparse)),
+			]
+		if self.emulator:
+			# linked into the emulator, the image only carries the version
+			kernel = self.pack("II", 0, _abi_version)
+		else:
+			kernel = yield from self.compile_cached(*sources, address=address)
+		if flash:
+			yield from self.load(kernel, address, force=True, boot=False)
+			yield from self.persist(kernel, address, params)
+		yield from self.load(kernel, address, slot=slot)
+		yield from self.req(MsgType.SETUP)
+		yield from self.req(MsgType.UPDATE, self.pack_events(params))
 		yield from self.req(MsgType.ARM)
 
+		if trace:
+			yield from self.trace_arm()
+		if profile:
+			yield from self.profile(clear=True)
 		yield from self.req(MsgType.TRIGGER)
 		for i in range(repeats):
 			n = {}
@@ -193,13 +713,25 @@ class Ventilator:
 				typ, status, data = yield from self.recv()
 				assert status == MsgStatus.NONE
 				if typ == MsgType.UPDATE:
-					r = struct.unpack(">%iI" % (len(data)//4), data)
+					r = self.unpack("%iI" % (len(data)//4), data)
 					for a in range(len(r) - 2):
 						n[a + r[1]] = r[2 + a]
+				if typ == MsgType.SPARSE:
+					n.update(self.unpack_sparse(data)[1])
 				if typ == MsgType.DONE:
 					break
 			logger.info("result %s", n)
 
+		if profile:
+			cycles, profiles = yield from self.profile()
+			for hook, p in sorted(profiles.items()):
+				if p.count:
+					logger.info("profile %s count=%i mean=%i max=%i "
+							"load=%.3g hist=%s", hook, p.count,
+							p.total//p.count, p.max, p.total/cycles,
+							p.hist)
+		if trace:
+			yield from self.trace_dump()
 		self.send(MsgType.CLEANUP)
 
 
@@ -214,20 +746,35 @@ Options:
 -p, --port <port>         serial port [default: /dev/ttyUSB1]
 -s, --speed <speed>       line speed [default: 115200]
 -a, --address <address>   load address [default: 0x40010000]
+-k, --slot <slot>         resident kernel slot [default: 0]
 -r, --repeats <repeats>   repetitions [default: 10]
 -x, --runs <runs>         runs [default: 100]
+-z, --sparse              sparse result encoding
+-f, --flash               store kernel and parameters in flash
+-b, --bench               run the firmware benchmarks
+-t, --trace               trace the gateware events of the kernel and
+                          dump the last ones
+-P, --profile             profile the firmware hooks during the kernel run
+-e, --emulator            talk to the host emulator (emulator/) on its pty,
+                          its kernel is linked in and SOURCE is ignored
 -d, --debug
 """
 	import docopt
 	args = docopt.docopt(main.__doc__)
-	v = Ventilator(args["--port"], int(args["--speed"]))
+	v = Ventilator(args["--port"], int(args["--speed"]), args["--emulator"])
 	if args["--debug"]:
 		logging.basicConfig(level=logging.DEBUG)
 	else:
 		logging.basicConfig(level=logging.INFO)
 
-	t = v.kernel(args["SOURCE"], address=int(args["--address"], 16),
-		runs=int(args["--runs"]), repeats=int(args["--repeats"]))
+	if args["--bench"]:
+		t = v.bench_all()
+	else:
+		t = v.kernel(args["SOURCE"], address=int(args["--address"], 16),
+			runs=int(args["--runs"]), repeats=int(args["--repeats"]),
+			sparse=args["--sparse"], slot=int(args["--slot"]),
+			flash=args["--flash"], trace=args["--trace"],
+			profile=args["--profile"])
 	asyncio.get_event_loop().run_until_complete(t)
 
 if __name__ == "__main__":
@@ -0,0 +1,204 @@
+#!/usr/bin/python3
+# Robert Jordens <jordens@gmail.com>, 2014
+
+"""Check an event sequence before running it.
+
+The Master dispatches the head of the output FIFO when the cycle
+equals its time, one event per cycle. An event that reaches the FIFO
+too late never matches and blocks the FIFO. This predicts that on
+the host from the sequence, the CPU push rate and the safe buffer
+that `tl` measures on the target.
+
+Sequences may hold the cycle at zero with VENTILATOR_CTRL_CLEAR_FORCE
+(see kernel.c). While it is held, time 0 events go out as they
+arrive. Releasing it at time 0 restarts the time from there.
+
+After VENTILATOR_CTRL_FINE_TIME the times count 1/8 cycles and the
+events go out at time >> 3.
+"""
+
+import logging
+from collections import namedtuple, deque
+
+from kernel import Event
+
+logger = logging.getLogger("ventilator")
+
+_fifo_depth = 256
+_wrap = 1 << 32
+_plausible = 1 << 30
+_ctrl_clear_force = 0x05
+_ctrl_fine_time = 0x06
+
+Report = namedtuple("Report", "events order slack late underflows "
+		"stalls stall_cycles high")
+
+
+def read_events(f):
+	"""Read "time addr data" lines, # starts a comment."""
+	for line in f:
+		line = line.split("#")[0].split()
+		if line:
+			yield Event(*(int(v, 0) for v in line))
+
+
+def read_push_trace(f):
+	"""Read the push trace of the emulator (ventilator-emulator -t),
+	"cpu-cycle time addr data" lines. Returns the events and their push
+	cycles relative to the first."""
+	events = []
+	pushes = []
+	for line in f:
+		cc, *ev = line.split()
+		events.append(Event(*(int(v, 0) for v in ev)))
+		pushes.append(int(cc))
+	return events, [cc - pushes[0] for cc in pushes]
+
+
+def simulate(events, cost, safe, depth=_fifo_depth, lead=0, pushes=None):
+	"""Simulate the output FIFO.
+
+	The CPU pushes one event every `cost` cycles or at the cycles in
+	`pushes`, starting `lead` cycles before the Master, and waits while
+	the FIFO is full. Times are cycles since the Master started.
+
+	Yields per event (index, push, dispatch, slack, level after the
+	push, cycles stalled, problem). Slack is the time left after the
+	push and the `safe` buffer, None while the cycle is held. An event
+	with negative slack is late and blocks the FIFO on the target, the
+	simulation lets it go out when it arrives. problem is None or why
+	the event can not be dispatched in order.
+	"""
+	fifo = deque()
+	p = -lead
+	d = -1
+	base = 0
+	time = 0
+	held = False
+	shift = 0
+	for i, ev in enumerate(events):
+		if pushes is not None:
+			p = max(p, pushes[i] - lead)
+		stalled = 0
+		while fifo and fifo[0] < p:
+			fifo.popleft()
+		if len(fifo) == depth:
+			stalled = fifo.popleft() + 1 - p
+			p += stalled
+		problem = None
+		slack = None
+		t = ev.time >> shift
+		if held:
+			if t:
+				problem = "held"
+			d = max(d + 1, p)
+		else:
+			delta = (t - time) % (_wrap >> shift)
+			if not 0 < delta < _plausible >> shift and (i or t):
+				problem = "order"
+				if delta >= _wrap >> shift + 1:
+					delta -= _wrap >> shift
+			time = t
+			base += delta
+			slack = base - p - safe
+			d = max(base, d + 1, p)
+		fifo.append(d)
+		yield i, p, d, slack, len(fifo), stalled, problem
+		if ev.addr == _ctrl_clear_force:
+			if ev.data:
+				# the cycle is zero from the next one on
+				held = True
+			elif held:
+				held = False
+				base = d + 1
+				time = 0
+		elif ev.addr == _ctrl_fine_time:
+			shift = 3 if ev.data & 1 else 0
+		p += cost
+
+
+def validate(events, cost, safe, depth=_fifo_depth, lead=0, pushes=None):
+	"""Return a Report: the number of events, the order problems as
+	(index, problem), the minimum slack, the late events as (index,
+	slack), the number of pushes into an empty FIFO while the cycle
+	runs, the number of pushes and cycles the CPU waited on a full FIFO
+	and the highest FIFO level."""
+	events = list(events)
+	order = []
+	slack = None
+	late = []
+	underflows = stalls = stall_cycles = high = 0
+	for i, p, d, s, level, stalled, problem in simulate(events, cost,
+			safe, depth, lead, pushes):
+		if problem:
+			order.append((i, problem))
+		if s is not None:
+			if slack is None or s < slack:
+				slack = s
+			if s < 0:
+				late.append((i, s))
+			if i and level == 1:
+				underflows += 1
+		if stalled:
+			stalls += 1
+			stall_cycles += stalled
+		high = max(high, level)
+	return Report(len(events), order, slack, late, underflows, stalls,
+			stall_cycles, high)
+
+
+def main():
+	"""
+Sequence timing validator and output FIFO predictor
+
+Usage: validate [options] [FILE]
+
+FILE has "time addr data" lines or, with --push-trace, is the push
+trace of the emulator (ventilator-emulator -t). Reads stdin without
+FILE. Exits with 1 if events are out of order or late.
+
+Options:
+
+-c, --cost <cycles>       CPU cycles per pushed event, see BENCH
+                          [default: 32]
+-b, --safe <cycles>       safe buffer from tl-safe [default: 512]
+-l, --lead <cycles>       pushing starts this many cycles before
+                          the Master [default: 0]
+-D, --depth <events>      output FIFO depth [default: 256]
+-t, --push-trace          FILE is an emulator push trace
+-m, --measured            with --push-trace, push at the recorded
+                          cycles, not every --cost cycles
+-n, --max <n>             list at most n problems [default: 10]
+"""
+	import sys
+	import docopt
+	args = docopt.docopt(main.__doc__)
+	logging.basicConfig(level=logging.INFO)
+
+	f = open(args["FILE"]) if args["FILE"] else sys.stdin
+	pushes = None
+	if args["--push-trace"]:
+		events, measured = read_push_trace(f)
+		if args["--measured"]:
+			pushes = measured
+	else:
+		events = list(read_events(f))
+	n = int(args["--max"])
+	r = validate(events, cost=int(args["--cost"]),
+			safe=int(args["--safe"]), depth=int(args["--depth"]),
+			lead=int(args["--lead"]), pushes=pushes)
+
+	for i, problem in r.order[:n]:
+		logger.info("%s index=%i time=%i addr=%#x", problem, i,
+				events[i].time, events[i].addr)
+	for i, s in r.late[:n]:
+		logger.info("late index=%i time=%i addr=%#x slack=%i",
+				i, events[i].time, events[i].addr, s)
+	logger.info("validate events=%i order=%i late=%i min-slack=%s "
+			"underflows=%i stalls=%i stall-cycles=%i high=%i",
+			r.events, len(r.order), len(r.late), r.slack, r.underflows,
+			r.stalls, r.stall_cycles, r.high)
+	sys.exit(bool(r.order or r.late))
+
+if __name__ == "__main__":
+	main()
@@ -0,0 +1,266 @@
+/* Robert Jordens <jordens@gmail.com>, 2014 */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <irq.h>
+#include <generated/csr.h>
+
+#include "ventilator.h"
+
+static const char * const bench_names[] = {
+	[VENTILATOR_BENCH_PUSH1_CSR] = "push1_csr",
+	[VENTILATOR_BENCH_PUSH1_WB] = "push1_wb",
+	[VENTILATOR_BENCH_PUSH1] = "push1",
+	[VENTILATOR_BENCH_PUSH_MANY] = "push_many",
+	[VENTILATOR_BENCH_POP_CSR] = "pop_csr",
+	[VENTILATOR_BENCH_POP_WB] = "pop_wb",
+	[VENTILATOR_BENCH_POP_MANY] = "pop_many",
+	[VENTILATOR_BENCH_ISR] = "isr",
+	[VENTILATOR_BENCH_RECV] = "recv",
+	[VENTILATOR_BENCH_SEND_ARRAY] = "send_array",
+};
+
+static ventilator_event_t bench_ev[VENTILATOR_FIFO_DEPTH];
+
+/* ISR events are this many cycles apart */
+#define BENCH_ISR_SPACING 1000
+/* main loop iterations longer than this were interrupted */
+#define BENCH_ISR_GAP 32
+
+static uint32_t bench_push1_csr(unsigned int n)
+{
+	unsigned int i;
+	uint32_t cc = ventilator_cc();
+	for (i=0; i<n; i++) {
+		while (ventilator_ev_status_read() & VENTILATOR_EV_OUT_OVERFLOW);
+		ventilator_out_time_write(i);
+		ventilator_out_addr_write(VENTILATOR_CTRL_NOP);
+		ventilator_out_data_write(i);
+		ventilator_out_next_write(0);
+	}
+	return ventilator_cc() - cc;
+}
+
+static uint32_t bench_push1_wb(unsigned int n)
+{
+	unsigned int i;
+	uint32_t cc = ventilator_cc();
+	for (i=0; i<n; i++)
+		ventilator_reg_push1(i, VENTILATOR_CTRL_NOP, i, 0);
+	return ventilator_cc() - cc;
+}
+
+static uint32_t bench_push1(unsigned int n)
+{
+	unsigned int i;
+	uint32_t cc = ventilator_cc();
+	for (i=0; i<n; i++)
+		ventilator_push1(i, VENTILATOR_CTRL_NOP, i, 0);
+	return ventilator_cc() - cc;
+}
+
+static uint32_t bench_push_many(unsigned int n)
+{
+	unsigned int i;
+	uint32_t cc;
+	for (i=0; i<n; i++) {
+		bench_ev[i].time = i;
+		bench_ev[i].addr = VENTILATOR_CTRL_NOP;
+		bench_ev[i].data = i;
+	}
+	cc = ventilator_cc();
+	ventilator_push_many(bench_ev, n, 0);
+	return ventilator_cc() - cc;
+}
+
+/*
+ * Queues n loopback events, spacing cycles apart. They start with
+ * releasing a clear force a kernel may have left set: the cycle counter
+ * would stay held and the tests below would wait for it forever.
+ */
+static void bench_loopback(unsigned int n, uint32_t spacing)
+{
+	unsigned int i;
+	ventilator_reg_push1(0, VENTILATOR_CTRL_CLEAR_FORCE, 0, 0);
+	for (i=0; i<n; i++)
+		ventilator_reg_push1((i + 1)*spacing, VENTILATOR_CTRL_LOOPBACK,
+				i, 0);
+}
+
+/* Has n loopback events waiting in the input FIFO */
+static int bench_fill(unsigned int n)
+{
+	bench_loopback(n, 1);
+	ventilator_start();
+	while ((VENTILATOR_IN_LEVEL < n) && (VENTILATOR_CYCLE < 2*n + 16));
+	ventilator_ctrl_prohibit_write(1);
+	return VENTILATOR_IN_LEVEL == n;
+}
+
+static uint32_t bench_pop_csr(unsigned int n)
+{
+	unsigned int i;
+	uint32_t cc = ventilator_cc();
+	for (i=0; i<n; i++) {
+		while (!(ventilator_ev_status_read() & VENTILATOR_EV_IN_READABLE));
+		bench_ev[i].time = ventilator_in_time_read();
+		bench_ev[i].addr = ventilator_in_addr_read();
+		bench_ev[i].data = ventilator_in_data_read();
+		ventilator_in_next_write(0);
+	}
+	return ventilator_cc() - cc;
+}
+
+static uint32_t bench_pop_wb(unsigned int n)
+{
+	unsigned int i;
+	uint32_t cc = ventilator_cc();
+	for (i=0; i<n; i++)
+		ventilator_reg_pop(&bench_ev[i], 0);
+	return ventilator_cc() - cc;
+}
+
+static uint32_t bench_pop_many(unsigned int n)
+{
+	uint32_t cc = ventilator_cc();
+	ventilator_pop_many(bench_ev, n, 0);
+	return ventilator_cc() - cc;
+}
+
+static volatile unsigned int bench_irqs;
+
+static uint32_t bench_isr(uint32_t pending)
+{
+	while (VENTILATOR_IN_LEVEL)
+		ventilator_reg_read(0);
+	bench_irqs++;
+	return pending;
+}
+
+/*
+ * Cycles the main context loses to n interrupts: entry, the minimal
+ * callback above and exit.
+ */
+static uint32_t bench_isr_cost(unsigned int n)
+{
+	void (*kernel)(ventilator_msg_t *) = ventilator->kernel;
+	uint32_t (*isr)(uint32_t) = ventilator->isr;
+	uint32_t irq = ventilator_ev_enable_read();
+	unsigned int mask = irq_getmask();
+	uint32_t last, cc, lost = 0;
+
+	bench_irqs = 0;
+	if (!ventilator_set_callbacks(kernel, bench_isr,
+				VENTILATOR_EV_IN_READABLE))
+		return 0; /* SUBSCRIBEd */
+	bench_loopback(n, BENCH_ISR_SPACING);
+	irq_setmask(mask | (1 << VENTILATOR_INTERRUPT));
+	ventilator_start();
+	last = ventilator_cc();
+	while ((bench_irqs < n) &&
+			(VENTILATOR_CYCLE < (n + 2)*BENCH_ISR_SPACING)) {
+		cc = ventilator_cc();
+		if (cc - last > BENCH_ISR_GAP)
+			lost += cc - last;
+		last = cc;
+	}
+	ventilator_stop();
+	irq_setmask(mask);
+	ventilator_set_callbacks(kernel, isr, irq);
+	return bench_irqs == n ? lost : 0;
+}
+
+static uint32_t bench_send_array(unsigned int n)
+{
+	ventilator_msg_t msg;
+	uint32_t cc = ventilator_cc();
+	ventilator_send_array(&msg, 0, 0, (const uint32_t *) bench_ev, n);
+	return ventilator_cc() - cc;
+}
+
+unsigned int ventilator_bench_max(unsigned int test)
+{
+	if (test == VENTILATOR_BENCH_SEND_ARRAY)
+		return len(bench_ev)*sizeof(ventilator_event_t)/sizeof(uint32_t);
+	if (test == VENTILATOR_BENCH_RECV)
+		return -1;
+	if ((test >= VENTILATOR_BENCH_POP_CSR) && (test <= VENTILATOR_BENCH_ISR))
+		return VENTILATOR_FIFO_DEPTH - 1; /* and the release */
+	return VENTILATOR_FIFO_DEPTH;
+}
+
+uint32_t ventilator_bench(unsigned int test, unsigned int n)
+{
+	uint32_t cycles = 0;
+	int ie;
+	if (!n || (n > ventilator_bench_max(test)))
+		return 0;
+	ie = irq_getie();
+	ventilator_stop();
+	switch (test) {
+		case VENTILATOR_BENCH_PUSH1_CSR:
+			irq_setie(0);
+			cycles = bench_push1_csr(n);
+			break;
+		case VENTILATOR_BENCH_PUSH1_WB:
+			irq_setie(0);
+			cycles = bench_push1_wb(n);
+			break;
+		case VENTILATOR_BENCH_PUSH1:
+			irq_setie(0);
+			cycles = bench_push1(n);
+			break;
+		case VENTILATOR_BENCH_PUSH_MANY:
+			irq_setie(0);
+			cycles = bench_push_many(n);
+			break;
+		case VENTILATOR_BENCH_POP_CSR:
+			irq_setie(0);
+			if (bench_fill(n))
+				cycles = bench_pop_csr(n);
+			break;
+		case VENTILATOR_BENCH_POP_WB:
+			irq_setie(0);
+			if (bench_fill(n))
+				cycles = bench_pop_wb(n);
+			break;
+		case VENTILATOR_BENCH_POP_MANY:
+			irq_setie(0);
+			if (bench_fill(n))
+				cycles = bench_pop_many(n);
+			break;
+		case VENTILATOR_BENCH_ISR:
+			cycles = bench_isr_cost(n);
+			break;
+		case VENTILATOR_BENCH_SEND_ARRAY:
+			cycles = bench_send_array(n);
+			break;
+	}
+	irq_setie(ie);
+	ventilator_stop();
+	return cycles;
+}
+
+void ventilator_bench_print(unsigned int test, unsigned int n,
+		uint32_t cycles)
+{
+	const char *name = "unknown";
+	uint64_t rate = 0;
+	if ((test < len(bench_names)) && bench_names[test])
+		name = bench_names[test];
+	if (cycles)
+		rate = (uint64_t) n*identifier_frequency_read()/cycles;
+	printf("bench test=%s n=%u cycles=%u per=%u rate=%u\n", name, n, cycles,
+			n ? cycles/n : 0, (uint32_t) rate);
+}
+
+/* The tests that do not talk to the host */
+void bench(void)
+{
+	unsigned int test, n;
+	for (test=VENTILATOR_BENCH_PUSH1_CSR; test<=VENTILATOR_BENCH_ISR; test++) {
+		n = ventilator_bench_max(test);
+		ventilator_bench_print(test, n, ventilator_bench(test, n));
+	}
+}
@@ -194,7 +194,12 @@ static void pulses(void)
 	}
 }
 
-static int tl1(int buf, int mode)
+/*
+ * Returns the input to output path latency, -1 if buf was too short.
+ * *react is set to the cycles from the input timestamp to after the
+ * output event was pushed.
+ */
+static int tl1(int buf, int mode, uint32_t *react)
 {
 #define TL_PIN 0x01
 	uint32_t t = 0, temp;
@@ -252,6 +257,14 @@ static int tl1(int buf, int mode)
 			break;
 #endif
 	}
+	if (react) {
+#ifdef VENTILATOR_WB_BASE
+		*react = VENTILATOR_CYCLE - t;
+#else
+		ventilator_ctrl_update_write(0);
+		*react = ventilator_ctrl_cycle_read() - t;
+#endif
+	}
 
 	do {
 		ventilator_ctrl_update_write(0);
@@ -261,10 +274,69 @@ static int tl1(int buf, int mode)
 	return eva.time - t;
 }
 
-static void tl(char* mode)
+static int tl_cmp(const void *a, const void *b)
 {
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
 #define BUF_START 512
 #define N_ITER 1000
+#define TL_BINS 16
+
+/*
+ * Reaction time distribution, one line of statistics and one of
+ * TL_BINS histogram counts (bins of width cycles from min on).
+ * The uart traffic goes into the fill= value of its own tl-traffic
+ * line, apart from the results.
+ */
+static void tl_dist(int mode, const char *variant, int irq, int uart)
+{
+	static uint32_t react[N_ITER];
+	unsigned int hist[TL_BINS];
+	uint32_t min, max, width;
+	int i, n = 0;
+
+	if (uart)
+		printf("tl-traffic mode=%d variant=%s fill=", mode, variant);
+	irq_setie(irq);
+	for (i=0; i<10; i++) /* warm up, caching */
+		tl1(BUF_START, mode, NULL);
+	for (i=0; i<N_ITER; i++) {
+		if (uart) /* tx interrupts during the measurement */
+			uart_write('.');
+		if (tl1(BUF_START, mode, &react[n]) >= 0)
+			n++;
+	}
+	irq_setie(1);
+	if (uart)
+		putchar('\n');
+	if (!n) {
+		printf("tl mode=%d variant=%s n=0\n", mode, variant);
+		return;
+	}
+
+	qsort(react, n, sizeof(*react), tl_cmp);
+	min = react[0];
+	max = react[n - 1];
+	printf("tl mode=%d variant=%s n=%d min=%u median=%u p99=%u max=%u "
+			"jitter=%u\n", mode, variant, n, min, react[n/2],
+			react[(n*99)/100], max, max - min);
+
+	width = (max - min)/TL_BINS + 1;
+	for (i=0; i<TL_BINS; i++)
+		hist[i] = 0;
+	for (i=0; i<n; i++)
+		hist[(react[i] - min)/width]++;
+	printf("tl-hist mode=%d variant=%s min=%u width=%u", mode, variant,
+			min, width);
+	for (i=0; i<TL_BINS; i++)
+		printf(" %u", hist[i]);
+	putchar('\n');
+}
+
+static void tl(char* mode)
+{
 	char *c;
 	int buf = BUF_START;
 	int dbuf = buf;
@@ -284,17 +356,17 @@ static void tl(char* mode)
 		dt = 0;
 		irq_setie(0);
 		for (i=0; i<10; i++) /* warm up, caching */
-			tl1(buf, mode2);
+			tl1(buf, mode2, NULL);
 		for (i=0; i<N_ITER; i++) {
-			ddt = tl1(buf, mode2);
+			ddt = tl1(buf, mode2, NULL);
 			if (ddt < 0)
 				break;
 			dt += ddt;
 		}
 		irq_setie(1);
 		lat = dt - i*buf;
-		printf("buf %d success %d/%d latency %d/%d\n",
-				buf, i, N_ITER, lat, N_ITER);
+		printf("tl-search mode=%d buf=%d success=%d/%d latency=%d/%d\n",
+				mode2, buf, i, N_ITER, lat, N_ITER);
 		dbuf /= 2;
 		if (i == N_ITER) {
 			buf -= dbuf;
@@ -304,7 +376,11 @@ static void tl(char* mode)
 	}
 	if (i != N_ITER)
 		buf += 1;
-	printf("safe cycle buffer: %d\n", buf);
+	printf("tl-safe mode=%d buf=%d\n", mode2, buf);
+
+	tl_dist(mode2, "irqoff", 0, 0);
+	tl_dist(mode2, "irqon", 1, 0);
+	tl_dist(mode2, "uart", 1, 1);
 	ttl_init();
 }
 
@@ -546,8 +622,10 @@ static void photon_phase(char *f)
 	fixedpt x, y, r, p;
 	unsigned int t_rf=0, t_pmt, i, f2;
 	ventilator_event_t ev;
-	const ventilator_event_t ev_tag[9] = {
+	/* fine time: the times carry the edge phases */
+	const ventilator_event_t ev_tag[10] = {
 		{0, VENTILATOR_CTRL_CLEAR_FORCE, 1},
+		{0, VENTILATOR_CTRL_FINE_TIME, 1},
 		{0, VENTILATOR_CTRL_START_IN, 1},
 		{0, VENTILATOR_GPIO_SENSE_FALL, PP_GATE},
 		{0, VENTILATOR_GPIO_SENSE_RISE, PP_GATE},
@@ -580,7 +658,7 @@ static void photon_phase(char *f)
 		if (!ventilator_pop(&ev, 1))
 			continue;
 		if (ev.data & PP_GATE) {
-			if ((ev.addr & ~0xf0) == VENTILATOR_GPIO_IN_FALL) {
+			if (ev.addr == VENTILATOR_GPIO_IN_FALL) {
 				puts("\\");
 				ventilator_stop();
 				ventilator_push_many(ev_tag, len(ev_tag), 0);
@@ -618,12 +696,12 @@ static void photon_phase(char *f)
 		}
 		if (ev.data & PP_RF) {
 			putsnonl("r");
-			t_rf = (ev.time << 3) + ((ev.addr & 0x70) >> 4);
+			t_rf = ev.time;
 			printf("%08d\n", t_rf);
 		}
 		if (ev.data & PP_PMT) {
 			putsnonl("p");
-			t_pmt = ((ev.time << 3) + ((ev.addr & 0x70) >> 4));
+			t_pmt = ev.time;
 			printf("%08d ", t_pmt);
 			t_pmt = (((t_pmt - t_rf)<<PP_T_SCALE) % f2)>>PP_T_SCALE;
 			printf("%08d\n", t_pmt);
@@ -660,6 +738,7 @@ static void help(void)
 	puts("to <t> <a> <d> - ventilator push out event");
 	puts("tp             - ventilator status");
 	puts("tl <mode>      - ventilator turn around measurement");
+	puts("bench          - ventilator throughput benchmarks");
 	puts("pp <rf>        - photon phase for rf freq");
 	puts("vx             - ventilator engine");
 }
@@ -747,9 +826,10 @@ static void do_command(char *c)
 	else if(strcmp(token, "ts") == 0) ventilator_start();
 	else if(strcmp(token, "th") == 0) ventilator_stop();
 	else if(strcmp(token, "tl") == 0) tl(get_token(&c));
+	else if(strcmp(token, "bench") == 0) bench();
 	else if(strcmp(token, "pp") == 0) photon_phase(get_token(&c));
 
-	else if(strcmp(token, "vx") == 0) ventilator_loop();
+	else if(strcmp(token, "vx") == 0) ventilator_loop(0);
 
 	else if(strcmp(token, "") != 0)
 		puts("Command not found");
@@ -759,6 +839,7 @@ int main(void)
 {
 	char buffer[64];
 
+	ventilator_fast_init();
 	irq_setmask(0);
 	irq_setie(1);
 	uart_init();
@@ -766,7 +847,7 @@ int main(void)
 	puts("Ventilator built "__DATE__" "__TIME__"\n");
 
 	puts("Starting engine\n");
-	ventilator_loop();
+	ventilator_loop(1);
 
 	ttl_init();
 		
@@ -14,16 +14,139 @@
 #include <generated/mem.h>
 
 #include <crc.h>
+#ifdef CSR_SPIFLASH_BASE
+#include <spiflash.h>
+#endif
 #include "ventilator.h"
 
+#define VENTILATOR_KERNELS 4
+
+static struct {
+	uint32_t adr;
+	uint32_t heap;
+	void (*kernel)(ventilator_msg_t *);
+} ventilator_kernels[VENTILATOR_KERNELS];
+static unsigned int ventilator_slot;
+/* the kernel whose .fast is in the SRAM */
+static uint32_t ventilator_fast_adr;
+
+/* below the firmware stack at the top of the SDRAM (_fstack) */
+#define VENTILATOR_STACK_SIZE 0x10000
+#define VENTILATOR_HEAP_END (SDRAM_BASE + SDRAM_SIZE - VENTILATOR_STACK_SIZE)
+/* above the firmware, see .os in kernel.ld and linker.ld */
+#define VENTILATOR_KERNEL_BASE (SDRAM_BASE + 0x10000)
+
+static struct {
+	uint32_t ptr;
+	uint32_t end;
+} arena;
+
+/*
+ * The arena of the active kernel extends from its _heapstart to the
+ * next resident kernel or the firmware stack.
+ */
+static void ventilator_arena_reset(void)
+{
+	unsigned int i;
+	arena.ptr = ventilator_kernels[ventilator_slot].heap;
+	arena.end = VENTILATOR_HEAP_END;
+	for (i=0; i<VENTILATOR_KERNELS; i++)
+		if (ventilator_kernels[i].kernel &&
+				(ventilator_kernels[i].adr >= arena.ptr) &&
+				(ventilator_kernels[i].adr < arena.end))
+			arena.end = ventilator_kernels[i].adr;
+	if (!ventilator_kernels[ventilator_slot].kernel)
+		arena.end = arena.ptr;
+}
+
+void *ventilator_alloc(unsigned int size)
+{
+	uint32_t ptr = (arena.ptr + 7) & ~7;
+	if ((ptr + size > arena.end) || (ptr + size < ptr))
+		return NULL;
+	arena.ptr = ptr + size;
+	return (void *) ptr;
+}
+
+/*
+ * The kernel entry (crt0) returns the message callback in r1
+ * and its _heapstart in r2. The second word of the kernel is its
+ * VENTILATOR_ABI_VERSION, the third the entry that only copies its
+ * .fast section.
+ */
+static int ventilator_boot(uint32_t adr, unsigned int slot)
+{
+	uint64_t ret;
+	void (*kernel)(ventilator_msg_t *);
+#ifdef VENTILATOR_EMULATOR
+	/* the stand-in image is big endian like any other */
+	if (__builtin_bswap32(MMPTR(adr + 4)) != VENTILATOR_ABI_VERSION)
+		return 0;
+	ret = ventilator_emulator_boot(adr);
+#else
+	if (MMPTR(adr + 4) != VENTILATOR_ABI_VERSION)
+		return 0;
+	flush_cpu_icache();
+	ret = ((uint64_t (*)(void)) adr)();
+#endif
+	kernel = (void (*)(ventilator_msg_t *)) (uint32_t) (ret >> 32);
+	ventilator_fast_adr = adr;
+	ventilator_kernels[slot].adr = adr;
+	ventilator_kernels[slot].heap = ret;
+	ventilator_kernels[slot].kernel = kernel;
+	ventilator_slot = slot;
+	ventilator_arena_reset();
+	ventilator_set_callbacks(kernel, NULL, 0);
+	return 1;
+}
+
+static void ventilator_activate(ventilator_msg_t *msg)
+{
+	if ((msg->len != sizeof(uint32_t))
+			|| (msg->data32[0] >= VENTILATOR_KERNELS)
+			|| !ventilator_kernels[msg->data32[0]].kernel) {
+		msg->status = VENTILATOR_MSG_NACK;
+	} else {
+		ventilator_stop();
+		ventilator_slot = msg->data32[0];
+		if (ventilator_kernels[ventilator_slot].adr != ventilator_fast_adr) {
+			ventilator_set_callbacks(NULL, NULL, 0);
+			ventilator_fast_adr = ventilator_kernels[ventilator_slot].adr;
+#ifndef VENTILATOR_EMULATOR
+			flush_cpu_icache();
+			((void (*)(void)) (ventilator_fast_adr + 8))();
+#endif
+		}
+		ventilator_arena_reset();
+		ventilator_set_callbacks(ventilator_kernels[ventilator_slot].kernel,
+				NULL, 0);
+	}
+	msg->len = 0;
+}
+
+static void ventilator_unload(ventilator_msg_t *msg)
+{
+	unsigned int slot;
+	if (msg->len == sizeof(uint32_t)) {
+		slot = msg->data32[0];
+		if (slot >= VENTILATOR_KERNELS) {
+			msg->status = VENTILATOR_MSG_NACK;
+		} else {
+			if (ventilator->kernel == ventilator_kernels[slot].kernel)
+				ventilator_set_callbacks(NULL, NULL, 0);
+			ventilator_kernels[slot].kernel = NULL;
+		}
+	} else {
+		ventilator_set_callbacks(NULL, NULL, 0);
+	}
+	msg->len = 0;
+}
+
 static void ventilator_load(ventilator_msg_t *msg)
 {
 	if (msg->len == sizeof(uint32_t)) {
-		uint32_t adr;
-		flush_cpu_icache();
-		adr = ((uint32_t (*)(void)) msg->data32[0])();
-		ventilator_set_callbacks((void (*)(ventilator_msg_t *)) adr,
-				NULL, 0);
+		if (!ventilator_boot(msg->data32[0], 0))
+			msg->status = VENTILATOR_MSG_NACK;
 	} else {
 		memcpy((void *) msg->data32[0], (void *) &msg->data32[1],
 				msg->len - sizeof(uint32_t));
@@ -31,8 +154,210 @@ static void ventilator_load(ventilator_msg_t *msg)
 	msg->len = 0;
 }
 
+/* Returns the end of the output, back-references stay above start */
+static uint8_t *ventilator_unpack(uint8_t *dst, const uint8_t *start,
+		const uint8_t *p, const uint8_t *end)
+{
+	unsigned int n, off;
+	uint8_t c;
+	while (p < end) {
+		c = *p++;
+		if (c < 0x80) {
+			n = c + 1;
+			if (p + n > end)
+				return NULL;
+			memcpy(dst, p, n);
+			dst += n;
+			p += n;
+		} else {
+			n = (c & 0x7f) + 3;
+			if (p + 2 > end)
+				return NULL;
+			off = (p[0] << 8) | p[1];
+			p += 2;
+			if (!off || (off > dst - start))
+				return NULL;
+			for (; n; n--, dst++)
+				*dst = *(dst - off);
+		}
+	}
+	return dst;
+}
+
+/*
+ * A frame that continues where the previous one ended belongs to the
+ * same image and may refer back into it.
+ */
+static void ventilator_loadz(ventilator_msg_t *msg)
+{
+	static uint8_t *start, *next;
+	uint8_t *dst;
+	if (msg->len < sizeof(uint32_t)) {
+		msg->status = VENTILATOR_MSG_NACK;
+	} else {
+		dst = (uint8_t *) msg->data32[0];
+		if (dst != next)
+			start = dst;
+		next = ventilator_unpack(dst, start,
+				&msg->data8[sizeof(uint32_t)], &msg->data8[msg->len]);
+		if (!next)
+			msg->status = VENTILATOR_MSG_NACK;
+	}
+	msg->len = 0;
+}
+
+static void ventilator_check_boot(ventilator_msg_t *msg)
+{
+	unsigned int slot = 0;
+	if (msg->len == 4*sizeof(uint32_t))
+		slot = msg->data32[3];
+	else if (msg->len != 3*sizeof(uint32_t))
+		slot = VENTILATOR_KERNELS;
+	if ((slot >= VENTILATOR_KERNELS) || (msg->data32[2] != crc32(
+				(const unsigned char *) msg->data32[0], msg->data32[1]))
+			|| !ventilator_boot(msg->data32[0], slot))
+		msg->status = VENTILATOR_MSG_NACK;
+	msg->len = 0;
+}
+
+#ifndef ROM_BASE
+#define ROM_BASE 0x00000000
+#endif
+#ifndef SPIFLASH_SECTOR_SIZE
+#define SPIFLASH_SECTOR_SIZE 0x10000
+#endif
+#define VENTILATOR_FLASH_IMAGE 0x200000
+#define VENTILATOR_FLASH_MAGIC 0x564b524e
+
+typedef struct ventilator_image_t {
+	uint32_t magic;
+	uint32_t adr;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t n;
+	ventilator_event_t param[(255 - 3*sizeof(uint32_t))/
+		sizeof(ventilator_event_t)];
+} ventilator_image_t;
+
+/* A kernel image has to lie between the firmware and its stack */
+static int ventilator_image_fits(uint32_t adr, uint32_t len)
+{
+	return (adr >= VENTILATOR_KERNEL_BASE) && (adr < VENTILATOR_HEAP_END) &&
+		(len <= VENTILATOR_HEAP_END - adr) && !(adr & 3);
+}
+
+static void ventilator_persist(ventilator_msg_t *msg)
+{
+#ifdef CSR_SPIFLASH_BASE
+	ventilator_image_t img;
+	unsigned int i;
+	if (msg->len && ((msg->len < 3*sizeof(uint32_t)) ||
+			!ventilator_image_fits(msg->data32[0], msg->data32[1]) ||
+			(msg->data32[2] != crc32((const unsigned char *) msg->data32[0],
+				msg->data32[1])))) {
+		msg->status = VENTILATOR_MSG_NACK;
+		msg->len = 0;
+		return;
+	}
+	memset(&img, 0, sizeof(img));
+	if (msg->len) {
+		img.magic = VENTILATOR_FLASH_MAGIC;
+		img.adr = msg->data32[0];
+		img.len = msg->data32[1];
+		img.crc = msg->data32[2];
+		img.n = (msg->len - 3*sizeof(uint32_t))/sizeof(ventilator_event_t);
+		memcpy(img.param, &msg->data32[3], img.n*sizeof(ventilator_event_t));
+	}
+	irq_setie(0);
+	for (i=0; i<sizeof(img) + img.len; i+=SPIFLASH_SECTOR_SIZE)
+		erase_flash_sector(VENTILATOR_FLASH_IMAGE + i);
+	if (msg->len) {
+		write_to_flash(VENTILATOR_FLASH_IMAGE + sizeof(img),
+				(const unsigned char *) img.adr, img.len);
+		write_to_flash(VENTILATOR_FLASH_IMAGE,
+				(const unsigned char *) &img, sizeof(img));
+	}
+	irq_setie(1);
+#else
+	msg->status = VENTILATOR_MSG_NACK;
+#endif
+	msg->len = 0;
+}
+
+static void ventilator_restore(void)
+{
+	const ventilator_image_t *img = (const ventilator_image_t *)
+		(ROM_BASE + VENTILATOR_FLASH_IMAGE);
+	ventilator_msg_t msg;
+	if ((img->magic != VENTILATOR_FLASH_MAGIC) || (img->n > len(img->param))
+			|| !ventilator_image_fits(img->adr, img->len))
+		return;
+	memcpy((void *) img->adr, (const void *) &img[1], img->len);
+	if (crc32((const unsigned char *) img->adr, img->len) != img->crc)
+		return;
+	if (!ventilator_boot(img->adr, 0) || !ventilator->kernel)
+		return;
+	msg.magic = VENTILATOR_MAGIC;
+	msg.status = VENTILATOR_MSG_NONE;
+	msg.type = VENTILATOR_MSG_SETUP;
+	msg.len = 0;
+	ventilator->kernel(&msg);
+	msg.type = VENTILATOR_MSG_UPDATE;
+	msg.len = img->n*sizeof(ventilator_event_t);
+	memcpy(msg.ev, img->param, msg.len);
+	ventilator->kernel(&msg);
+}
+
+static void ventilator_hash(ventilator_msg_t *msg)
+{
+	if (msg->len != 2*sizeof(uint32_t)) {
+		msg->status = VENTILATOR_MSG_NACK;
+		msg->len = 0;
+		return;
+	}
+	msg->data32[0] = crc32((const unsigned char *) msg->data32[0],
+			msg->data32[1]);
+	msg->len = sizeof(uint32_t);
+}
+
 #define VENTILATOR_MSG_MAX_FAIL 5
 
+#ifdef VENTILATOR_EMULATOR
+/*
+ * The wire is big endian like the target. On the little endian host
+ * the payload words are swapped, the byte streams are not: the
+ * leading payload bytes that are words.
+ */
+static unsigned int ventilator_wire_words(const ventilator_msg_t *msg)
+{
+	if (msg->status == VENTILATOR_MSG_REQ) {
+		if ((msg->type == VENTILATOR_MSG_LOAD) ||
+				(msg->type == VENTILATOR_MSG_LOADZ))
+			return sizeof(uint32_t); /* the address */
+		if (msg->type == VENTILATOR_MSG_PUSH_PACKED)
+			return 0;
+	}
+	if ((msg->type == VENTILATOR_MSG_EVENTS) ||
+			(msg->type == VENTILATOR_MSG_SPARSE))
+		return 0;
+	return msg->len & ~3;
+}
+
+static void ventilator_wire_order(ventilator_msg_t *msg)
+{
+	unsigned int i, n = ventilator_wire_words(msg)/sizeof(uint32_t);
+	for (i=0; i<n; i++)
+		msg->data32[i] = __builtin_bswap32(msg->data32[i]);
+}
+
+#define ventilator_wire_byte(msg, i) \
+	((msg)->data8[(unsigned int) (i) < ventilator_wire_words(msg) ? \
+		(i) ^ 3 : (i)])
+#else
+#define ventilator_wire_order(msg)
+#define ventilator_wire_byte(msg, i) ((msg)->data8[i])
+#endif
+
 static int ventilator_recv(ventilator_msg_t **tmsg)
 {
 	static ventilator_msg_t msg;
@@ -53,6 +378,7 @@ static int ventilator_recv(ventilator_msg_t **tmsg)
 		} else if (len == 4 + msg.len) {
 			len = 0;
 			fail = 0;
+			ventilator_wire_order(&msg);
 			*tmsg = &msg;
 			break;
 		}
@@ -60,26 +386,487 @@ static int ventilator_recv(ventilator_msg_t **tmsg)
 	return 1;
 }
 
-static void ventilator_get_status(ventilator_msg_t *msg)
+#define VENTILATOR_STREAM_RING 128
+
+static volatile struct {
+	uint32_t batch;
+	uint32_t age;
+	uint32_t dropped;
+	unsigned int produce, consume;
+	ventilator_event_t ring[VENTILATOR_STREAM_RING];
+} stream;
+
+static uint32_t ventilator_irq VENTILATOR_FAST_DATA;
+static volatile uint32_t ventilator_epoch VENTILATOR_FAST_DATA;
+
+#if VENTILATOR_PROFILE
+static struct {
+	uint32_t count;
+	uint64_t total;
+	uint32_t max;
+	uint32_t hist[VENTILATOR_PROFILE_BINS];
+} ventilator_profile[VENTILATOR_PROFILE_HOOKS] VENTILATOR_FAST_DATA;
+static uint32_t ventilator_profile_since;
+
+/* Inlined: the hooks run from SRAM and SDRAM */
+static inline __attribute__((always_inline)) void ventilator_profile_add(
+		unsigned int hook, uint32_t cc)
 {
+	unsigned int i;
+	cc = ventilator_cc() - cc;
+	ventilator_profile[hook].count++;
+	ventilator_profile[hook].total += cc;
+	if (cc > ventilator_profile[hook].max)
+		ventilator_profile[hook].max = cc;
+	for (i=0; (i < VENTILATOR_PROFILE_BINS - 1) &&
+			(cc >= ((uint32_t) VENTILATOR_PROFILE_BIN0 << 2*i)); i++);
+	ventilator_profile[hook].hist[i]++;
+}
+
+#define ventilator_profile_start() ventilator_cc()
+#define ventilator_profile_end(hook, cc) ventilator_profile_add(hook, cc)
+#else
+#define ventilator_profile_start() 0
+#define ventilator_profile_end(hook, cc) ((void) (cc))
+#endif
+
+static uint8_t *ventilator_put_varint(uint8_t *p, uint32_t v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static unsigned int ventilator_varint_len(uint32_t v)
+{
+	unsigned int n = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		n++;
+	}
+	return n;
+}
+
+static const uint8_t *ventilator_get_varint(const uint8_t *p,
+		const uint8_t *end, uint32_t *v)
+{
+	unsigned int s = 0;
+	*v = 0;
+	while ((p < end) && (s < 35)) { /* at most 5 bytes */
+		*v |= ((uint32_t) (*p & 0x7f)) << s;
+		s += 7;
+		if (!(*p++ & 0x80))
+			return p;
+	}
+	return NULL;
+}
+
+/* Inlined: ventilator_cycle64() runs from SRAM */
+static inline __attribute__((always_inline)) uint32_t ventilator_now(void)
+{
+#ifdef VENTILATOR_WB_BASE
+	return VENTILATOR_CYCLE;
+#else
 	ventilator_ctrl_update_write(0);
-	msg->ev[0].time = ventilator_ctrl_cycle_read();
-	msg->ev[0].addr = 0;
-	msg->ev[0].data = ventilator_ev_status_read();
+	return ventilator_ctrl_cycle_read();
+#endif
+}
+
+/*
+ * ventilator_cycle64() in the unit of the event times: in fine time
+ * the last 1/8 cycle of the current cycle
+ */
+static inline __attribute__((always_inline)) uint64_t ventilator_time64(void)
+{
+	uint64_t now = ventilator_cycle64();
+	if (ventilator_ctrl_fine_read())
+		now = (now << 3) | 7;
+	return now;
+}
+
+static void VENTILATOR_FAST ventilator_stream_isr(void)
+{
+	ventilator_event_t ev;
+	unsigned int next;
+	while (ventilator_pop(&ev, 1)) {
+		next = (stream.produce + 1) % VENTILATOR_STREAM_RING;
+		if (next == stream.consume) {
+			stream.dropped++;
+			continue;
+		}
+		stream.ring[stream.produce].time = ev.time;
+		stream.ring[stream.produce].addr = ev.addr;
+		stream.ring[stream.produce].data = ev.data;
+		stream.produce = next;
+	}
+}
+
+/* Sends one EVENTS frame with the dropped count and events up to produce */
+static void ventilator_stream_flush(unsigned int produce)
+{
+	static ventilator_msg_t msg;
+	uint8_t *p = msg.data8;
+	uint8_t *end = msg.data8 + sizeof(msg.data8) - 3*5;
+	uint32_t t = 0;
+	uint64_t now;
+	unsigned int i, ie = irq_getie();
+
+	irq_setie(0);
+	p = ventilator_put_varint(p, stream.dropped);
+	stream.dropped = 0;
+	irq_setie(ie);
+	if (stream.consume != produce) {
+		now = ventilator_time64();
+		t = stream.ring[stream.consume].time;
+		p = ventilator_put_varint(p, (now - ((uint32_t) now - t)) >> 32);
+		t = 0;
+	} else {
+		p = ventilator_put_varint(p, 0);
+	}
+	for (i=stream.consume; (i != produce) && (p <= end);
+			i = (i + 1) % VENTILATOR_STREAM_RING) {
+		p = ventilator_put_varint(p, stream.ring[i].time - t);
+		p = ventilator_put_varint(p, stream.ring[i].addr);
+		p = ventilator_put_varint(p, stream.ring[i].data);
+		t = stream.ring[i].time;
+	}
+	stream.consume = i;
+	msg.type = VENTILATOR_MSG_EVENTS;
+	msg.status = VENTILATOR_MSG_NONE;
+	msg.len = p - msg.data8;
+	ventilator_send(&msg);
+}
+
+/*
+ * Sends the events buffered so far, not those the IRQ adds meanwhile:
+ * the input may well be faster than the UART.
+ */
+static void ventilator_stream_drain(void)
+{
+	unsigned int produce = stream.produce;
+	if ((stream.consume == produce) && !stream.dropped)
+		return;
+	do
+		ventilator_stream_flush(produce);
+	while (stream.consume != produce);
+}
+
+static void ventilator_stream_poll(void)
+{
+	unsigned int n, consume = stream.consume;
+	uint32_t age;
+	n = (stream.produce - consume) % VENTILATOR_STREAM_RING;
+	if (!n && !stream.dropped)
+		return;
+	/* in cycles */
+	if (ventilator_ctrl_fine_read())
+		age = ((ventilator_now() << 3 | 7) -
+				stream.ring[consume].time) >> 3;
+	else
+		age = ventilator_now() - stream.ring[consume].time;
+	if ((n < stream.batch) && !stream.dropped && (age < stream.age))
+		return;
+	ventilator_stream_flush(stream.produce);
+}
+
+static void ventilator_subscribe(ventilator_msg_t *msg)
+{
+	if ((msg->len != 2*sizeof(uint32_t)) || ventilator->isr) {
+		msg->status = VENTILATOR_MSG_NACK;
+	} else {
+		/* stop filling the ring, then send what is left */
+		stream.batch = 0;
+		ventilator_set_callbacks(ventilator->kernel, ventilator->isr,
+				ventilator_irq);
+		ventilator_stream_drain();
+		irq_setie(0);
+		stream.batch = min(msg->data32[0], VENTILATOR_STREAM_RING - 1);
+		stream.age = msg->data32[1];
+		stream.produce = stream.consume = 0;
+		stream.dropped = 0;
+		irq_setie(1);
+		ventilator_set_callbacks(ventilator->kernel, ventilator->isr,
+				ventilator_irq);
+	}
+	msg->len = 0;
+}
+
+#ifdef CSR_VENTILATOR_COUNTERS_SNAPSHOT_ADDR
+static const struct {
+	uint32_t id;
+	uint32_t (*read)(void);
+} ventilator_counters[] = {
+	{VENTILATOR_COUNTER_OUT_HIGH, ventilator_out_high_read},
+	{VENTILATOR_COUNTER_IN_HIGH, ventilator_in_high_read},
+	{VENTILATOR_COUNTER_ACK_STALLS, ventilator_ack_stalls_read},
+	{VENTILATOR_COUNTER_LATE, ventilator_late_read},
+	{VENTILATOR_COUNTER_IN_CONFLICTS, ventilator_in_conflicts_read},
+	{VENTILATOR_COUNTER_OUT_DROPS, ventilator_out_drops_read},
+	{VENTILATOR_COUNTER_IN_DROPS, ventilator_in_drops_read},
+	{VENTILATOR_COUNTER_DISPATCHED + 0, ventilator_dispatched0_read},
+#ifdef CSR_VENTILATOR_DISPATCHED1_ADDR
+	{VENTILATOR_COUNTER_DISPATCHED + 1, ventilator_dispatched1_read},
+#endif
+#ifdef CSR_VENTILATOR_DISPATCHED2_ADDR
+	{VENTILATOR_COUNTER_DISPATCHED + 2, ventilator_dispatched2_read},
+#endif
+#ifdef CSR_VENTILATOR_DISPATCHED3_ADDR
+	{VENTILATOR_COUNTER_DISPATCHED + 3, ventilator_dispatched3_read},
+#endif
+};
+#endif
+
+static uint32_t ventilator_bench_recv(unsigned int n, uint32_t *bytes)
+{
+	ventilator_msg_t *msg;
+	uint32_t cc = 0;
+	int first = 1;
+	*bytes = 0;
+	while (n) {
+		if (!ventilator_recv(&msg))
+			return 0;
+		if (!msg)
+			continue;
+		if (first)
+			cc = ventilator_cc();
+		else
+			*bytes += 4 + msg->len;
+		first = 0;
+		n--;
+	}
+	return ventilator_cc() - cc;
+}
+
+/* msg may be overwritten by the RECV frames, it is the same buffer */
+static void ventilator_run_bench(ventilator_msg_t *msg)
+{
+	uint32_t test, n, cycles;
+	if (msg->len != 2*sizeof(uint32_t)) {
+		msg->status = VENTILATOR_MSG_NACK;
+		msg->len = 0;
+		return;
+	}
+	test = msg->data32[0];
+	n = msg->data32[1];
+	if (test == VENTILATOR_BENCH_RECV)
+		cycles = ventilator_bench_recv(n, &n);
+	else
+		cycles = ventilator_bench(test, n);
+	msg->type = VENTILATOR_MSG_BENCH;
+	msg->status = cycles ? VENTILATOR_MSG_REQ : VENTILATOR_MSG_NACK;
+	msg->ev[0].time = cycles;
+	msg->ev[0].addr = test;
+	msg->ev[0].data = n;
 	msg->len = sizeof(ventilator_event_t);
 }
 
+static void ventilator_get_status(ventilator_msg_t *msg)
+{
+	unsigned int i = 0, clear = 0;
+	uint64_t cycle = ventilator_cycle64();
+	if (msg->len == sizeof(uint32_t))
+		clear = msg->data32[0];
+	msg->ev[0].time = cycle;
+	msg->ev[0].addr = cycle >> 32;
+	msg->ev[0].data = ventilator_ev_status_read();
+#ifdef CSR_VENTILATOR_COUNTERS_SNAPSHOT_ADDR
+	ventilator_counters_snapshot_write(0);
+	if (clear)
+		ventilator_counters_clear_write(0);
+	for (i=0; i<len(ventilator_counters); i++) {
+		msg->ev[i + 1].time = 0;
+		msg->ev[i + 1].addr = ventilator_counters[i].id;
+		msg->ev[i + 1].data = ventilator_counters[i].read();
+	}
+#endif
+	msg->len = (i + 1)*sizeof(ventilator_event_t);
+}
+
+static void ventilator_get_profile(ventilator_msg_t *msg)
+{
+#if VENTILATOR_PROFILE
+	unsigned int i, j, k = 0, clear = 0;
+	if (msg->len == sizeof(uint32_t))
+		clear = msg->data32[0];
+	irq_setie(0);
+	msg->data32[k++] = ventilator_cc() - ventilator_profile_since;
+	for (i=0; i<VENTILATOR_PROFILE_HOOKS; i++) {
+		msg->data32[k++] = ventilator_profile[i].count;
+		msg->data32[k++] = ventilator_profile[i].total;
+		msg->data32[k++] = ventilator_profile[i].total >> 32;
+		msg->data32[k++] = ventilator_profile[i].max;
+		for (j=0; j<VENTILATOR_PROFILE_BINS; j++)
+			msg->data32[k++] = ventilator_profile[i].hist[j];
+	}
+	if (clear) {
+		memset(ventilator_profile, 0, sizeof(ventilator_profile));
+		ventilator_profile_since = ventilator_cc();
+	}
+	irq_setie(1);
+	msg->len = k*sizeof(uint32_t);
+#else
+	msg->status = VENTILATOR_MSG_NACK;
+	msg->len = 0;
+#endif
+}
+
+#ifdef CSR_VENTILATOR_TRACE_ARM_ADDR
+static void ventilator_trace(ventilator_msg_t *msg)
+{
+	unsigned int n = msg->len/sizeof(uint32_t), i, k = 0;
+	uint32_t cmd = n ? msg->data32[0] : 0, idx = 0;
+	if (n > 1)
+		idx = msg->data32[1];
+	msg->len = 0;
+	switch (cmd) {
+		case VENTILATOR_TRACE_ARM:
+			if (n != 5)
+				break;
+			ventilator_trace_sources_write(msg->data32[1]);
+			ventilator_trace_addr_write(msg->data32[2]);
+			ventilator_trace_mask_write(msg->data32[3]);
+			ventilator_trace_post_write(msg->data32[4]);
+			ventilator_trace_arm_write(0);
+			return;
+		case VENTILATOR_TRACE_STOP:
+			ventilator_trace_stop_write(0);
+			return;
+		case VENTILATOR_TRACE_STATE:
+			msg->data32[0] = ventilator_trace_state_read();
+			msg->data32[1] = ventilator_trace_trigger_cycle_read();
+			msg->data32[2] = ventilator_trace_out_count_read();
+			msg->data32[3] = ventilator_trace_in_count_read();
+			msg->len = 4*sizeof(uint32_t);
+			return;
+		case VENTILATOR_TRACE_OUT:
+			n = ventilator_trace_out_count_read();
+			for (i=idx; (i<n) && (k<len(msg->data32) - 3); i++) {
+				ventilator_trace_out_index_write(i);
+				msg->data32[k++] = ventilator_trace_out_cycle_read();
+				msg->data32[k++] = ventilator_trace_out_time_read();
+				msg->data32[k++] = ventilator_trace_out_addr_read();
+				msg->data32[k++] = ventilator_trace_out_data_read();
+			}
+			msg->len = k*sizeof(uint32_t);
+			return;
+		case VENTILATOR_TRACE_IN:
+			n = ventilator_trace_in_count_read();
+			for (i=idx; (i<n) && (k<len(msg->ev)); i++, k++) {
+				ventilator_trace_in_index_write(i);
+				msg->ev[k].time = ventilator_trace_in_time_read();
+				msg->ev[k].addr = ventilator_trace_in_addr_read();
+				msg->ev[k].data = ventilator_trace_in_data_read();
+			}
+			msg->len = k*sizeof(ventilator_event_t);
+			return;
+	}
+	msg->status = VENTILATOR_MSG_NACK;
+}
+#else
+static void ventilator_trace(ventilator_msg_t *msg)
+{
+	msg->status = VENTILATOR_MSG_NACK;
+	msg->len = 0;
+}
+#endif
+
+static uint32_t ventilator_out_credits(void)
+{
+	int k;
+#ifdef VENTILATOR_WB_BASE
+	k = VENTILATOR_FIFO_DEPTH - (int) VENTILATOR_OUT_LEVEL;
+#else
+	k = VENTILATOR_FIFO_DEPTH - (int) ventilator_out_level_read();
+#endif
+	return k > 0 ? k : 0;
+}
+
+static uint32_t ventilator_dict[VENTILATOR_PACKED_INDEX + 1];
+
+static void ventilator_set_dict(ventilator_msg_t *msg)
+{
+	unsigned int i, n = msg->len/sizeof(uint32_t);
+	if (!n || (n - 1 > len(ventilator_dict)) ||
+			(msg->data32[0] > len(ventilator_dict) - (n - 1))) {
+		msg->status = VENTILATOR_MSG_NACK;
+	} else {
+		for (i=1; i<n; i++)
+			ventilator_dict[msg->data32[0] + i - 1] = msg->data32[i];
+	}
+	msg->len = 0;
+}
+
+/* Returns whether all events were pushed, n counts them */
+static int ventilator_push_packed(const uint8_t *p, const uint8_t *end,
+		int *n)
+{
+	uint32_t t, dt, addr, data;
+	uint8_t tag;
+	*n = 0;
+	p = ventilator_get_varint(p, end, &t);
+	while (p && (p < end)) {
+		tag = *p++;
+		p = ventilator_get_varint(p, end, &dt);
+		t += dt;
+		addr = ventilator_dict[tag & VENTILATOR_PACKED_INDEX];
+		if (p && (tag & VENTILATOR_PACKED_ADDR))
+			p = ventilator_get_varint(p, end, &addr);
+		data = 0;
+		if (p && (tag & VENTILATOR_PACKED_DATA))
+			p = ventilator_get_varint(p, end, &data);
+		if (!p || !ventilator_push1(t, addr, data, 1))
+			return 0;
+		(*n)++;
+	}
+	return p != NULL;
+}
+
+/*
+ * The host pipelines PUSH frames. Once one did not go in completely,
+ * the ones already behind it are not taken either, or the events would
+ * go out of order. An empty PUSH resumes.
+ */
+static int ventilator_push_held;
+
+static void ventilator_push_reply(ventilator_msg_t *msg, int n, int ok)
+{
+	if (!ok) {
+		ventilator_push_held = 1;
+		msg->status = VENTILATOR_MSG_NACK;
+	}
+	msg->data32[0] = ventilator_out_credits();
+	msg->data32[1] = n;
+	msg->len = 2*sizeof(uint32_t);
+}
+
 static int ventilator_handle(ventilator_msg_t *msg)
 {
 	int req = (msg->status == VENTILATOR_MSG_REQ);
-	int ev_len;
+	int n, k, ok;
 	switch (msg->type) {
 		case VENTILATOR_MSG_LOAD:
 			ventilator_load(msg);
 			break;
+		case VENTILATOR_MSG_LOADZ:
+			ventilator_loadz(msg);
+			break;
+		case VENTILATOR_MSG_BOOT:
+			ventilator_check_boot(msg);
+			break;
+		case VENTILATOR_MSG_HASH:
+			ventilator_hash(msg);
+			break;
 		case VENTILATOR_MSG_UNLOAD:
-			msg->len = 0;
-			ventilator_set_callbacks(NULL, NULL, 0);
+			ventilator_unload(msg);
+			break;
+		case VENTILATOR_MSG_PERSIST:
+			ventilator_persist(msg);
+			break;
+		case VENTILATOR_MSG_ACTIVATE:
+			ventilator_activate(msg);
 			break;
 		case VENTILATOR_MSG_EXIT:
 			msg->len = 0;
@@ -97,16 +884,42 @@ static int ventilator_handle(ventilator_msg_t *msg)
 			ventilator_stop();
 			break;
 		case VENTILATOR_MSG_PUSH:
-			ev_len = msg->len/sizeof(ventilator_event_t);
-			msg->len = 0;
-			if (ventilator_push_many(msg->ev, ev_len, 1) < ev_len)
-				msg->status = VENTILATOR_MSG_NACK;
+			k = msg->len/sizeof(ventilator_event_t);
+			if (!k)
+				ventilator_push_held = 0;
+			n = ventilator_push_held ? 0 :
+				ventilator_push_many(msg->ev, k, 1);
+			ventilator_push_reply(msg, n, n == k);
+			break;
+		case VENTILATOR_MSG_DICT:
+			ventilator_set_dict(msg);
+			break;
+		case VENTILATOR_MSG_PUSH_PACKED:
+			n = 0;
+			ok = !ventilator_push_held && ventilator_push_packed(
+					msg->data8, msg->data8 + msg->len, &n);
+			ventilator_push_reply(msg, n, ok);
 			break;
 		case VENTILATOR_MSG_POP:
 			msg->len = sizeof(ventilator_event_t) * ventilator_pop_many(
 					msg->ev, len(msg->ev), 1);
 			break;
+		case VENTILATOR_MSG_SUBSCRIBE:
+			ventilator_subscribe(msg);
+			break;
+		case VENTILATOR_MSG_BENCH:
+			ventilator_run_bench(msg);
+			break;
+		case VENTILATOR_MSG_TRACE:
+			ventilator_trace(msg);
+			break;
+		case VENTILATOR_MSG_PROFILE:
+			ventilator_get_profile(msg);
+			break;
 		default:
+			if ((msg->type == VENTILATOR_MSG_SETUP)
+					|| (msg->type == VENTILATOR_MSG_CLEANUP))
+				ventilator_arena_reset();
 			if (ventilator->kernel) {
 				ventilator->kernel(msg);
 			} else {
@@ -133,7 +946,7 @@ void ventilator_send(const ventilator_msg_t *msg)
 	uart_write(msg->status);
 	uart_write(msg->len);
 	for (i=0; i<msg->len; i++)
-		uart_write(msg->data8[i]);
+		uart_write(ventilator_wire_byte(msg, i));
 }
 
 void ventilator_send_many(ventilator_msg_t *msg,
@@ -172,20 +985,55 @@ void ventilator_send_array(ventilator_msg_t *msg,
 	}
 }
 
-void ventilator_set_callbacks(void (*kernel)(ventilator_msg_t*),
+void ventilator_send_sparse(ventilator_msg_t *msg,
+		uint32_t time, uint32_t addr,
+		const uint32_t *data, unsigned int n)
+{
+	unsigned int i = 0, j, k, m;
+	uint8_t *p, *end = msg->data8 + sizeof(msg->data8);
+	msg->type = VENTILATOR_MSG_SPARSE;
+	msg->status = VENTILATOR_MSG_NONE;
+	do {
+		p = ventilator_put_varint(msg->data8, time);
+		p = ventilator_put_varint(p, addr + i);
+		while ((i < n) && (p + 3*5 <= end)) {
+			for (j=i; (j < n) && !data[j]; j++);
+			for (k=0, m=2*5; (j + k < n) && data[j + k]; k++) {
+				m += ventilator_varint_len(data[j + k]);
+				if (p + m > end)
+					break;
+			}
+			p = ventilator_put_varint(p, j - i);
+			p = ventilator_put_varint(p, k);
+			for (i=j; i<j+k; i++)
+				p = ventilator_put_varint(p, data[i]);
+		}
+		msg->len = p - msg->data8;
+		ventilator_send(msg);
+	} while (i < n);
+}
+
+int ventilator_set_callbacks(void (*kernel)(ventilator_msg_t*),
 		uint32_t (*isr)(uint32_t), uint32_t irq)
 {
 	uint32_t ack;
+	if (isr && stream.batch)
+		return 0;
 	ventilator->kernel = kernel;
+	ventilator_irq = irq;
+	irq |= VENTILATOR_EV_WRAP;
+	if (stream.batch)
+		irq |= VENTILATOR_EV_IN_READABLE;
 	ack = irq & ~ventilator_ev_enable_read();
 	irq_setie(0);
 	ventilator_ev_pending_write(ack);
 	ventilator_ev_enable_write(irq);
 	ventilator->isr = isr;
 	irq_setie(1);
+	return 1;
 }
 
-static ventilator_t _ventilator = {
+static ventilator_t _ventilator VENTILATOR_FAST_DATA = {
 		.start = &ventilator_start,
 		.stop = &ventilator_stop,
 		.set_callbacks = &ventilator_set_callbacks,
@@ -197,19 +1045,51 @@ static ventilator_t _ventilator = {
 		.pop_many = &ventilator_pop_many,
 		.send = &ventilator_send,
 		.send_many = &ventilator_send_many,
-		.send_array = &ventilator_send_array
+		.send_array = &ventilator_send_array,
+		.send_sparse = &ventilator_send_sparse,
+		.alloc = &ventilator_alloc,
+		.cycle64 = &ventilator_cycle64,
+		.push64 = &ventilator_push64,
+		.pop64 = &ventilator_pop64
 };
 
-void ventilator_isr(void)
+void VENTILATOR_FAST (ventilator_isr)(void)
 {
-	uint32_t stat, temp;
+	uint32_t stat, cc = ventilator_profile_start(), cck;
+#ifndef VENTILATOR_EMULATOR
+	uint32_t temp;
 	asm volatile ("mv %0, r25\n\t": "=r" (temp));
+#endif
 	ventilator = &_ventilator;
 	stat = ventilator_ev_pending_read();
-	if (ventilator->isr)
-		stat = ventilator->isr(stat);
+	if (stat & VENTILATOR_EV_WRAP)
+		ventilator_epoch++;
+	if (stream.batch && (stat & VENTILATOR_EV_IN_READABLE))
+		ventilator_stream_isr();
+	if (ventilator->isr) {
+		cck = ventilator_profile_start();
+		stat = ventilator->isr(stat & ~VENTILATOR_EV_WRAP) |
+			(stat & VENTILATOR_EV_WRAP);
+		ventilator_profile_end(VENTILATOR_PROFILE_KERNEL_ISR, cck);
+	}
 	ventilator_ev_pending_write(stat);
+	ventilator_profile_end(VENTILATOR_PROFILE_ISR, cc);
+#ifndef VENTILATOR_EMULATOR
 	asm volatile ("mv r25, %0\n\t":: "r" (temp));
+#endif
+}
+
+extern uint32_t _ffast[], _efast[], _lfast[];
+
+/* before any interrupt: the ISR path lives in SRAM */
+void ventilator_fast_init(void)
+{
+#ifndef VENTILATOR_EMULATOR
+	uint32_t *dst = _ffast, *src = _lfast;
+	while (dst < _efast)
+		*dst++ = *src++;
+	flush_cpu_icache();
+#endif
 }
 
 void ventilator_init(void)
@@ -218,7 +1098,15 @@ void ventilator_init(void)
 	uart_sync();
 	uart_divisor_write(identifier_frequency_read()/115200/16);
 	ventilator = &_ventilator;
+#ifdef CSR_VENTILATOR_OUT_DEPTH_ADDR
+	if ((ventilator_out_depth_read() != VENTILATOR_FIFO_DEPTH) ||
+			(ventilator_in_depth_read() != VENTILATOR_FIFO_DEPTH))
+		printf("ventilator: FIFO depth %i/%i, firmware assumes %i\n",
+				ventilator_out_depth_read(), ventilator_in_depth_read(),
+				VENTILATOR_FIFO_DEPTH);
+#endif
 	ventilator_stop();
+	stream.batch = 0;
 	ventilator_set_callbacks(NULL, NULL, 0);
 	mask = irq_getmask();
 	mask |= 1 << VENTILATOR_INTERRUPT;
@@ -229,6 +1117,7 @@ static void ventilator_exit(void)
 {
 	unsigned int mask;
 	ventilator_stop();
+	stream.batch = 0;
 	ventilator_set_callbacks(NULL, NULL, 0);
 	uart_divisor_write(identifier_frequency_read()/115200/16);
 	mask = irq_getmask();
@@ -244,30 +1133,66 @@ void ventilator_start(void)
 
 void ventilator_stop(void)
 {
+	unsigned int ie = irq_getie();
 	ventilator_ctrl_prohibit_write(1);
+	if (stream.batch) {
+		/* send what is in, in the epoch it came in */
+		irq_setie(0);
+		VENTILATOR_FAR(ventilator_stream_isr)();
+		irq_setie(ie);
+		ventilator_stream_drain();
+	}
 	ventilator_out_flush_write(0);
 	ventilator_in_flush_write(0);
+	irq_setie(0);
+	/* forget a wrap from before the clear */
 	ventilator_ctrl_clear_write(0);
+	ventilator_ev_pending_write(VENTILATOR_EV_WRAP);
+	ventilator_epoch = 0;
+	irq_setie(ie);
 }
 
-void ventilator_loop(void)
+void ventilator_loop(int restore)
 {
 	ventilator_msg_t *msg;
+	uint32_t cc;
+	int ret;
 	ventilator_init();
+	if (restore)
+		ventilator_restore();
 	while (1) {
 		if (!ventilator_recv(&msg))
 			break;
+		cc = ventilator_profile_start();
 		if (msg) {
-			if (!ventilator_handle(msg))
+			ret = ventilator_handle(msg);
+			ventilator_profile_end(VENTILATOR_PROFILE_HANDLE, cc);
+			if (!ret)
 				break;
-		} else if (ventilator->kernel) {
-			ventilator->kernel(NULL);
+		} else {
+			if (stream.batch)
+				ventilator_stream_poll();
+			if (ventilator->kernel) {
+				ventilator->kernel(NULL);
+				ventilator_profile_end(VENTILATOR_PROFILE_POLL, cc);
+			}
 		}
 	}
 	ventilator_exit();
 }
 
-inline int ventilator_push1(uint32_t time, uint32_t addr, uint32_t data, int noblock)
+/* SRAM from here on, calls among these can be direct */
+#undef ventilator_push1
+#undef ventilator_push
+#undef ventilator_pop
+#undef ventilator_push_many
+#undef ventilator_pop_many
+#undef ventilator_pop_count
+#undef ventilator_cycle64
+#undef ventilator_push64
+#undef ventilator_pop64
+
+inline int VENTILATOR_FAST ventilator_push1(uint32_t time, uint32_t addr, uint32_t data, int noblock)
 {
 	while (ventilator_ev_status_read() & VENTILATOR_EV_OUT_OVERFLOW)
 		if (noblock)
@@ -285,12 +1210,12 @@ inline int ventilator_push1(uint32_t time, uint32_t addr, uint32_t data, int nob
 	return 1;
 }
 
-inline int ventilator_push(const ventilator_event_t *ev, int noblock)
+inline int VENTILATOR_FAST ventilator_push(const ventilator_event_t *ev, int noblock)
 {
 	return ventilator_push1(ev->time, ev->addr, ev->data, noblock);
 }
 
-inline int ventilator_pop(ventilator_event_t *ev, int noblock)
+inline int VENTILATOR_FAST ventilator_pop(ventilator_event_t *ev, int noblock)
 {
 	while (!(ventilator_ev_status_read() & VENTILATOR_EV_IN_READABLE))
 		if (noblock)
@@ -310,25 +1235,33 @@ inline int ventilator_pop(ventilator_event_t *ev, int noblock)
 	return 1;
 }
 
-int ventilator_push_many(const ventilator_event_t *ev, int n, int noblock)
+int VENTILATOR_FAST ventilator_push_many(const ventilator_event_t *ev, int n, int noblock)
 {
+#ifdef VENTILATOR_WB_BASE
+	return ventilator_reg_push_many(ev, n, noblock);
+#else
 	int i;
 	for (i=0; i<n; i++)
 		if (!ventilator_push1(ev[i].time, ev[i].addr, ev[i].data, noblock))
 			break;
 	return i;
+#endif
 }
 
-int ventilator_pop_many(ventilator_event_t *ev, int n, int noblock)
+int VENTILATOR_FAST ventilator_pop_many(ventilator_event_t *ev, int n, int noblock)
 {
+#ifdef VENTILATOR_WB_BASE
+	return ventilator_reg_pop_many(ev, n, noblock);
+#else
 	int i = 0;
 	for (i=0; i<n; i++)
 		if (!ventilator_pop(&ev[i], noblock))
 			break;
 	return i;
+#endif
 }
 
-int ventilator_pop_count(uint32_t addr, uint32_t mask, uint32_t *counter, int noblock)
+int VENTILATOR_FAST ventilator_pop_count(uint32_t addr, uint32_t mask, uint32_t *counter, int noblock)
 {
 	uint32_t a, n=0;
 	while (1) {
@@ -354,3 +1287,39 @@ int ventilator_pop_count(uint32_t addr, uint32_t mask, uint32_t *counter, int no
 		*counter += n;
 	return 0;
 }
+
+/* An unacknowledged wrap is counted if the cycle is past it */
+uint64_t VENTILATOR_FAST ventilator_cycle64(void)
+{
+	unsigned int ie = irq_getie();
+	uint32_t cycle, epoch;
+	irq_setie(0);
+	cycle = ventilator_now();
+	epoch = ventilator_epoch;
+	if ((ventilator_ev_pending_read() & VENTILATOR_EV_WRAP) &&
+			!(cycle >> 31))
+		epoch++;
+	irq_setie(ie);
+	return ((uint64_t) epoch << 32) | cycle;
+}
+
+int VENTILATOR_FAST ventilator_push64(uint64_t time, uint32_t addr, uint32_t data, int noblock)
+{
+	int64_t ahead = time - ventilator_time64();
+	if ((ahead < 0) || (ahead > VENTILATOR_PUSH64_AHEAD))
+		return -1;
+	return ventilator_push1(time, addr, data, noblock);
+}
+
+int VENTILATOR_FAST ventilator_pop64(ventilator_event_t *ev, uint64_t *time, int noblock)
+{
+	ventilator_event_t e;
+	uint64_t now;
+	if (!ev)
+		ev = &e;
+	if (!ventilator_pop(ev, noblock))
+		return 0;
+	now = ventilator_time64();
+	*time = now - ((uint32_t) now - ev->time);
+	return 1;
+}
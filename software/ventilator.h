@@ -3,6 +3,16 @@
 #ifndef __HW_VENTILATOR_H
 #define __HW_VENTILATOR_H
 
+/*
+ * Version of the kernel interface: ventilator_t, the messages and
+ * the inline register API below. crt0 stores it in the second word
+ * of a kernel and the firmware refuses to boot kernels built against
+ * a different version. Bump on incompatible changes.
+ */
+#define VENTILATOR_ABI_VERSION		3
+
+#ifndef __ASSEMBLER__
+
 #include <stdint.h>
 #include <hw/common.h>
 #include <base/irq.h>
@@ -19,10 +29,25 @@
 #define likely(x)  __builtin_expect(!!(x), 1)
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
+#ifdef VENTILATOR_EMULATOR
+/*
+ * Host build against the Master model in emulator/. Register
+ * accesses and the CPU cycle counter are calls into the model,
+ * the kernel is linked in.
+ */
+volatile uint32_t *ventilator_emulator_reg(unsigned int x);
+uint32_t ventilator_emulator_cc(void);
+uint64_t ventilator_emulator_boot(uint32_t adr);
+#endif
+
 #define VENTILATOR_WB_BASE		0xb0000000
 
 #ifdef VENTILATOR_WB_BASE
+#ifdef VENTILATOR_EMULATOR
+	#define VENTILATOR_REG(x)		(*ventilator_emulator_reg(x))
+#else
 	#define VENTILATOR_REG(x)		MMPTR(VENTILATOR_WB_BASE | (4*(x)))
+#endif
 	#define VENTILATOR_CYCLE		VENTILATOR_REG(0x00)
 	#define VENTILATOR_STATUS		VENTILATOR_REG(0x01)
 	#define VENTILATOR_IN_TIME		VENTILATOR_REG(0x02)
@@ -33,6 +58,56 @@
 	#define VENTILATOR_OUT_ADDR		VENTILATOR_REG(0x07)
 	#define VENTILATOR_OUT_DATA		VENTILATOR_REG(0x08)
 	#define VENTILATOR_OUT_WE		VENTILATOR_REG(0x09)
+	#define VENTILATOR_OUT_LEVEL	VENTILATOR_REG(0x0a)
+	#define VENTILATOR_IN_LEVEL		VENTILATOR_REG(0x0b)
+#endif
+
+/*
+ * FIFO capacity: Master(depth=256) plus the output register of
+ * SyncFIFOBuffered. ventilator_init() checks it against the gateware.
+ */
+#define VENTILATOR_FIFO_DEPTH		257
+
+/*
+ * Profile the firmware hooks with the CPU cycle counter, see
+ * VENTILATOR_MSG_PROFILE. Costs a few dozen cycles per hook.
+ */
+#ifndef VENTILATOR_PROFILE
+#define VENTILATOR_PROFILE			0
+#endif
+
+/*
+ * Fine time: after VENTILATOR_CTRL_FINE_TIME with data 1, event times
+ * count 1/8 cycles, time = cycle<<3 | phase. The Master dispatches at
+ * time>>3 and hands the phase to the slaves: HiresGpio puts its edge
+ * there instead of in addr bits 4-6, the others ignore it. Input
+ * events are tagged the same way, HiresGpio edges with their phase.
+ * Times wrap every 1<<29 cycles. Set it while the cycle is held by
+ * VENTILATOR_CTRL_CLEAR_FORCE; ventilator_stop() turns it off.
+ * push64(), pop64() and the EVENTS epoch then use 64 bit fine time,
+ * cycle64() << 3 | phase. cycle64() and STATUS stay in cycles.
+ *
+ * Building with VENTILATOR_FINE_TIME=1 makes the sequence helpers
+ * below (at_us(), seq_gpio_us(), ...) count fine time. The sequence
+ * must then start with seq_fine_time() while the cycle is held.
+ */
+#ifndef VENTILATOR_FINE_TIME
+#define VENTILATOR_FINE_TIME		0
+#endif
+#define VENTILATOR_TIME_SHIFT		(3*VENTILATOR_FINE_TIME)
+
+/*
+ * Code and data placed in on-chip SRAM. Copied there from SDRAM by
+ * ventilator_fast_init() (firmware) and crt0 (kernels). The lower half
+ * of the SRAM belongs to the firmware, the upper half to the most
+ * recently booted kernel.
+ */
+#ifdef VENTILATOR_EMULATOR
+#define VENTILATOR_FAST
+#define VENTILATOR_FAST_DATA
+#else
+#define VENTILATOR_FAST			__attribute__((section(".fastcode")))
+#define VENTILATOR_FAST_DATA	__attribute__((section(".fastdata")))
 #endif
 
 #define VENTILATOR_EV_IN_READABLE	0x01
@@ -41,6 +116,7 @@
 #define VENTILATOR_EV_OUT_READABLE	0x08
 #define VENTILATOR_EV_STARTED		0x10
 #define VENTILATOR_EV_STOPPED		0x20
+#define VENTILATOR_EV_WRAP			0x40 /* cycle counted over 2^32 - 1 */
 
 #define VENTILATOR_CTRL				0x00000000
 #define VENTILATOR_GPIO				0x00000100
@@ -52,6 +128,7 @@
 #define VENTILATOR_CTRL_PROHIBIT_UNDERFLOW	(VENTILATOR_CTRL + 0x03)
 #define VENTILATOR_CTRL_STOP_ONCE		(VENTILATOR_CTRL + 0x04)
 #define VENTILATOR_CTRL_CLEAR_FORCE		(VENTILATOR_CTRL + 0x05)
+#define VENTILATOR_CTRL_FINE_TIME		(VENTILATOR_CTRL + 0x06)
 #define VENTILATOR_CTRL_NOP				(VENTILATOR_CTRL + 0xff)
 
 #define VENTILATOR_GPIO_I			(VENTILATOR_GPIO + 0x0)
@@ -69,19 +146,211 @@
 #define VENTILATOR_WISHBONE_ADDR	0x00ffffff
 #define VENTILATOR_WISHBONE_DDS		0x00000000
 
+#define VENTILATOR_COUNTER_OUT_HIGH		0x01 /* FIFO levels */
+#define VENTILATOR_COUNTER_IN_HIGH		0x02
+#define VENTILATOR_COUNTER_ACK_STALLS	0x03 /* cycles */
+#define VENTILATOR_COUNTER_LATE			0x04 /* cycles */
+#define VENTILATOR_COUNTER_IN_CONFLICTS	0x05 /* cycles */
+#define VENTILATOR_COUNTER_OUT_DROPS	0x06 /* events */
+#define VENTILATOR_COUNTER_IN_DROPS		0x07 /* events */
+#define VENTILATOR_COUNTER_DISPATCHED	0x10 /* + slave, events */
+
 #define VENTILATOR_MAGIC	0xa5
 
+/*
+ * Message types: 0x10-0x1f firmware and kernel management, 0x20-0x2f
+ * handled by the kernel, 0x30-0x3f event streaming.
+ */
 #define VENTILATOR_MSG_NONE		0x00
 #define VENTILATOR_MSG_ERR		0xff
+
+/*
+ * Writes data8[4...] to address data32[0]. With only the address,
+ * starts the kernel there and keeps it resident in slot 0. Starting
+ * is NACKed if the kernel was built for another VENTILATOR_ABI_VERSION.
+ */
 #define VENTILATOR_MSG_LOAD		0x10
+
+/*
+ * Deactivates the current kernel, it stays resident. With data32[0],
+ * instead forgets the resident kernel in that slot and deactivates it
+ * only if it is the current one. NACKed for an invalid slot.
+ */
 #define VENTILATOR_MSG_UNLOAD	0x11
 #define VENTILATOR_MSG_EXIT		0x12
+
+/*
+ * Replies with ev[0] = {cycle, epoch, ev status} followed by the
+ * gateware counters as {0, VENTILATOR_COUNTER_*, value}. With data32[0] != 0
+ * the counters are cleared after reading.
+ */
 #define VENTILATOR_MSG_STATUS	0x13
 #define VENTILATOR_MSG_START	0x14
 #define VENTILATOR_MSG_STOP		0x15
+
+/*
+ * Compressed LOAD: data32[0] is the destination address, followed
+ * by tokens. A token byte c < 0x80 is followed by c + 1 literal
+ * bytes, c >= 0x80 copies (c & 0x7f) + 3 bytes from a 16 bit big
+ * endian backwards offset into the already written output. That is
+ * this frame's and that of the frames directly before it, if each
+ * started where the previous one ended. NACKed if it reaches further.
+ */
+#define VENTILATOR_MSG_LOADZ	0x16
+
+/*
+ * Checks that the CRC32 of data32[1] bytes at address data32[0]
+ * is data32[2] and then starts the kernel there like LOAD.
+ * The kernel is kept resident in slot data32[3] (default 0).
+ * NACKed on CRC or ABI version mismatch.
+ */
+#define VENTILATOR_MSG_BOOT		0x17
+
+/*
+ * Pushes the events without blocking. The reply carries the
+ * number of free output FIFO slots after the push (the credits)
+ * in data32[0] and the number of events pushed in data32[1].
+ * The push is NACKed if not all events fit. Later PUSH and
+ * PUSH_PACKED frames are then NACKed without pushing anything
+ * until a PUSH without events, which only reports the credits.
+ */
 #define VENTILATOR_MSG_PUSH		0x18
 #define VENTILATOR_MSG_POP		0x19
 
+/*
+ * Returns in data32[0] the CRC32 of data32[1] bytes of memory at
+ * address data32[0], e.g. of a resident kernel image.
+ */
+#define VENTILATOR_MSG_HASH		0x1a
+
+/*
+ * Stops and activates the resident kernel in slot data32[0]
+ * without reloading it. Its .fast section is copied to the SRAM
+ * again if another kernel was booted since, .fastdata starts over
+ * from its initial values. SETUP it afterwards.
+ */
+#define VENTILATOR_MSG_ACTIVATE	0x1b
+
+/*
+ * Writes the kernel image of data32[1] bytes at data32[0] with
+ * CRC32 data32[2] and the UPDATE events from data8[12...] as its
+ * default parameters to SPI flash. The kernel is restored, SETUP
+ * and UPDATEd on boot. Without data, clears the flash image.
+ * Load the image but do not BOOT it before PERSISTing.
+ */
+#define VENTILATOR_MSG_PERSIST	0x1c
+
+/*
+ * Runs benchmark data32[0] (VENTILATOR_BENCH_*) over data32[1]
+ * events, words or frames and replies with {cycles, test, n} in CPU
+ * cycles, 0 cycles if it failed. SEND_ARRAY sends its UPDATE frames
+ * before the reply. For RECV, the host sends n frames after the
+ * request, timed from the end of the first to the end of the last;
+ * n is then the number of bytes timed.
+ */
+#define VENTILATOR_MSG_BENCH	0x1d
+
+#define VENTILATOR_BENCH_PUSH1_CSR	0x01
+#define VENTILATOR_BENCH_PUSH1_WB	0x02
+#define VENTILATOR_BENCH_PUSH1		0x03
+#define VENTILATOR_BENCH_PUSH_MANY	0x04
+#define VENTILATOR_BENCH_POP_CSR	0x05
+#define VENTILATOR_BENCH_POP_WB		0x06
+#define VENTILATOR_BENCH_POP_MANY	0x07
+#define VENTILATOR_BENCH_ISR		0x08 /* n interrupts */
+#define VENTILATOR_BENCH_RECV		0x09
+#define VENTILATOR_BENCH_SEND_ARRAY	0x0a
+
+/*
+ * Reads and controls the gateware event trace. data32[0] is the
+ * command. ARM with data32[1...] = {VENTILATOR_TRACE_SOURCE_*, addr,
+ * mask, post} clears the trace and records. STOP stops recording.
+ * STATE replies with {VENTILATOR_TRACE_ARMED/TRIGGERED, trigger
+ * cycle, out count, in count}. OUT and IN reply with the entries
+ * from index data32[1] on, 0 being the oldest: {cycle, time, addr,
+ * data} per dispatched output event, events for the input.
+ * NACKed if the gateware has no trace.
+ */
+#define VENTILATOR_MSG_TRACE	0x1e
+
+/*
+ * Replies with the firmware profile: data32[0] are the CPU cycles
+ * since it was cleared, then per VENTILATOR_PROFILE_* hook {count,
+ * total cycles (low, high word), max cycles, histogram}. Histogram
+ * bin i counts the calls below VENTILATOR_PROFILE_BIN0 << 2*i cycles,
+ * the last bin all longer ones. With data32[0] != 0 the profile is
+ * cleared after reading. NACKed unless built with VENTILATOR_PROFILE.
+ */
+#define VENTILATOR_MSG_PROFILE	0x1f
+
+#define VENTILATOR_PROFILE_ISR		0x00 /* ventilator_isr() */
+#define VENTILATOR_PROFILE_KERNEL_ISR	0x01 /* the kernel isr callback */
+#define VENTILATOR_PROFILE_POLL		0x02 /* kernel(NULL) */
+#define VENTILATOR_PROFILE_HANDLE	0x03 /* message handling */
+#define VENTILATOR_PROFILE_HOOKS	4
+#define VENTILATOR_PROFILE_BINS		8
+#define VENTILATOR_PROFILE_BIN0		64
+
+#define VENTILATOR_TRACE_ARM	0x01
+#define VENTILATOR_TRACE_STOP	0x02
+#define VENTILATOR_TRACE_STATE	0x03
+#define VENTILATOR_TRACE_OUT	0x04
+#define VENTILATOR_TRACE_IN		0x05
+
+#define VENTILATOR_TRACE_SOURCE_OUT		0x01 /* out addr & mask == addr */
+#define VENTILATOR_TRACE_SOURCE_IN		0x02 /* in addr & mask == addr */
+#define VENTILATOR_TRACE_SOURCE_LATE	0x04
+#define VENTILATOR_TRACE_SOURCE_STOP	0x08
+
+#define VENTILATOR_TRACE_ARMED		0x01
+#define VENTILATOR_TRACE_TRIGGERED	0x02
+
+/*
+ * Subscribes to input events: data32[0] is the batch size in
+ * events (0 unsubscribes), data32[1] the maximum age in cycles of
+ * the oldest buffered event. While subscribed, the input FIFO is
+ * drained in the IRQ and the events are sent unsolicited as EVENTS
+ * frames. NACKed if a kernel IRQ callback is installed. The buffered
+ * events are sent on STOP (before the cycle counter is cleared) and
+ * when unsubscribing.
+ */
+#define VENTILATOR_MSG_SUBSCRIBE	0x30
+
+/*
+ * Unsolicited batch of input events. data8[] is a sequence of
+ * varints: the number of events dropped since the last frame, the
+ * epoch of the first event (of the fine time in fine time mode),
+ * then (time delta, addr, data) per event. The first delta is
+ * relative to zero, later ones wrap.
+ */
+#define VENTILATOR_MSG_EVENTS	0x31
+
+/*
+ * Sets entries of the PUSH_PACKED address dictionary: data32[0] is
+ * the first index, data32[1...] are the addresses.
+ */
+#define VENTILATOR_MSG_DICT		0x32
+
+/*
+ * Like PUSH, with the events in compact encoding: a varint start
+ * time followed by, per event, a tag byte and a varint time delta
+ * to the previous event. The tag selects the address from the
+ * dictionary or flags a varint literal address, and flags whether
+ * a varint data word follows (data is zero otherwise).
+ */
+#define VENTILATOR_MSG_PUSH_PACKED	0x33
+
+/*
+ * Unsolicited sparse array, see ventilator_send_sparse(). data8[]
+ * is a sequence of varints: time, address of the first element,
+ * then runs of (number of zeros, number of values k, k values).
+ */
+#define VENTILATOR_MSG_SPARSE	0x34
+
+#define VENTILATOR_PACKED_INDEX	0x1f
+#define VENTILATOR_PACKED_ADDR	0x20
+#define VENTILATOR_PACKED_DATA	0x40
+
 /*
  * Bring hardware to a state that can be
  * ARMed. Needs to be idempotent (work from any state).
@@ -151,7 +420,7 @@ typedef struct ventilator_t {
 	uint32_t (* isr)(uint32_t pending);
 	void (* const start)(void);
 	void (* const stop)(void);
-	void (* const set_callbacks)(void (*kernel)(ventilator_msg_t *),
+	int (* const set_callbacks)(void (*kernel)(ventilator_msg_t *),
 			uint32_t (*isr)(uint32_t), uint32_t irq);
 	int (* const push1)(uint32_t time, uint32_t addr, uint32_t data, int noblock);
 	int (* const push)(const ventilator_event_t *ev, int noblock);
@@ -165,12 +434,24 @@ typedef struct ventilator_t {
 	void (* const send_array)(ventilator_msg_t *msg,
 			uint32_t time, uint32_t addr,
 			const uint32_t *data, unsigned int n);
+	void (* const send_sparse)(ventilator_msg_t *msg,
+			uint32_t time, uint32_t addr,
+			const uint32_t *data, unsigned int n);
+	void *(* const alloc)(unsigned int size);
+	uint64_t (* const cycle64)(void);
+	int (* const push64)(uint64_t time, uint32_t addr, uint32_t data, int noblock);
+	int (* const pop64)(ventilator_event_t *ev, uint64_t *time, int noblock);
 } ventilator_t;
 
+#ifdef VENTILATOR_EMULATOR
+extern ventilator_t *ventilator;
+#else
 register ventilator_t *ventilator asm ("r25");
+#endif
 
+void ventilator_fast_init(void);
 void ventilator_init(void);
-void ventilator_loop(void);
+void ventilator_loop(int restore);
 void ventilator_isr(void);
 void ventilator_start(void);
 void ventilator_stop(void);
@@ -180,8 +461,10 @@ void ventilator_stop(void);
  * Returns acknowledged IRQs.
  * If a FIFO interface is used here, it can not be used in normal
  * context while the IRQ is allowed.
+ * Returns 0 and changes nothing if an isr would take the input FIFO
+ * from a SUBSCRIBE stream.
  */
-void ventilator_set_callbacks(void (*kernel)(ventilator_msg_t *),
+int ventilator_set_callbacks(void (*kernel)(ventilator_msg_t *),
 		uint32_t (*isr)(uint32_t), uint32_t irq);
 int ventilator_push1(uint32_t time, uint32_t addr, uint32_t data, int noblock);
 int ventilator_push(const ventilator_event_t *ev, int noblock);
@@ -189,12 +472,80 @@ int ventilator_pop(ventilator_event_t *ev, int noblock);
 int ventilator_push_many(const ventilator_event_t *ev, int n, int noblock);
 int ventilator_pop_many(ventilator_event_t *ev, int n, int noblock);
 int ventilator_pop_count(uint32_t addr, uint32_t mask, uint32_t *counter, int noblock);
+
+/*
+ * The 64 bit timeline: the firmware counts the wraps of the 32 bit
+ * cycle (the epoch) from the last ventilator_stop(). A forced clear
+ * (VENTILATOR_CTRL_CLEAR_FORCE) restarts the cycle but not the epoch,
+ * the gateware only signals a wrap when the cycle counts over.
+ * push64() does not push and returns -1 for events in the past or
+ * more than VENTILATOR_PUSH64_AHEAD (in event time units) ahead, 0 if
+ * the FIFO is
+ * full with noblock. pop64() extends the event time, the event must
+ * be less than a wrap old.
+ */
+#define VENTILATOR_PUSH64_AHEAD		(1 << 30)
+uint64_t ventilator_cycle64(void);
+int ventilator_push64(uint64_t time, uint32_t addr, uint32_t data, int noblock);
+int ventilator_pop64(ventilator_event_t *ev, uint64_t *time, int noblock);
+
 void ventilator_send(const ventilator_msg_t *msg);
 void ventilator_send_many(ventilator_msg_t *msg,
 		const ventilator_event_t *ev, unsigned int n);
 void ventilator_send_array(ventilator_msg_t *msg,
 		uint32_t time, uint32_t addr,
 		const uint32_t *data, unsigned int n);
+/*
+ * Like ventilator_send_array() but zero runs are skipped and values
+ * are varints. Much more compact for sparse histograms.
+ */
+void ventilator_send_sparse(ventilator_msg_t *msg,
+		uint32_t time, uint32_t addr,
+		const uint32_t *data, unsigned int n);
+
+/*
+ * Allocates 8 byte aligned memory for the active kernel from the
+ * region after its _heapstart. Returns NULL if exhausted. Everything
+ * is released before SETUP and CLEANUP are handed to the kernel.
+ */
+void *ventilator_alloc(unsigned int size);
+
+/* Runs a VENTILATOR_BENCH_* test, returns the CPU cycles it took */
+uint32_t ventilator_bench(unsigned int test, unsigned int n);
+unsigned int ventilator_bench_max(unsigned int test);
+void ventilator_bench_print(unsigned int test, unsigned int n,
+		uint32_t cycles);
+void bench(void);
+
+/* The CPU cycle counter */
+#ifdef VENTILATOR_EMULATOR
+#define ventilator_cc() ventilator_emulator_cc()
+#else
+#define ventilator_cc() ({ uint32_t _cc; \
+		asm volatile ("rcsr %0, CC" : "=r" (_cc)); _cc; })
+#endif
+
+/*
+ * calli only reaches +-128MB. Calls between SDRAM and the
+ * VENTILATOR_FAST code in SRAM have to go through a register.
+ * The empty asm keeps the compiler from turning it back into a calli.
+ */
+#define VENTILATOR_FAR(f) ({ __typeof__(&(f)) _f = &(f); \
+		asm ("" : "+r" (_f)); _f; })
+
+#define ventilator_isr() VENTILATOR_FAR(ventilator_isr)()
+#define ventilator_push1(...) VENTILATOR_FAR(ventilator_push1)(__VA_ARGS__)
+#define ventilator_push(...) VENTILATOR_FAR(ventilator_push)(__VA_ARGS__)
+#define ventilator_pop(...) VENTILATOR_FAR(ventilator_pop)(__VA_ARGS__)
+#define ventilator_push_many(...) \
+	VENTILATOR_FAR(ventilator_push_many)(__VA_ARGS__)
+#define ventilator_pop_many(...) \
+	VENTILATOR_FAR(ventilator_pop_many)(__VA_ARGS__)
+#define ventilator_pop_count(...) \
+	VENTILATOR_FAR(ventilator_pop_count)(__VA_ARGS__)
+#define ventilator_cycle64() VENTILATOR_FAR(ventilator_cycle64)()
+#define ventilator_push64(...) VENTILATOR_FAR(ventilator_push64)(__VA_ARGS__)
+#define ventilator_pop64(...) VENTILATOR_FAR(ventilator_pop64)(__VA_ARGS__)
 
 /*
  * Called on KERNEL message reception and very frequently in each
@@ -203,6 +554,95 @@ void ventilator_send_array(ventilator_msg_t *msg,
 void ventilator_kernel(ventilator_msg_t *msg);
 
 
+#ifdef VENTILATOR_WB_BASE
+/*
+ * Inline register API. Kernels can use these instead of the
+ * ventilator_t calls in their inner loops. The same caveat as for the
+ * isr callback applies: a FIFO must not be used from both contexts.
+ */
+/* Never negative */
+static inline int ventilator_reg_out_free(void)
+{
+	int k = VENTILATOR_FIFO_DEPTH - (int) VENTILATOR_OUT_LEVEL;
+	return k > 0 ? k : 0;
+}
+
+static inline unsigned int ventilator_reg_in_level(void)
+{
+	return VENTILATOR_IN_LEVEL;
+}
+
+/* Unchecked, needs a free slot */
+static inline void ventilator_reg_write(uint32_t time, uint32_t addr,
+		uint32_t data)
+{
+	VENTILATOR_OUT_TIME = time;
+	VENTILATOR_OUT_ADDR = addr;
+	VENTILATOR_OUT_DATA = data;
+	VENTILATOR_OUT_WE = 0;
+}
+
+/* Unchecked, needs a pending event, ev may be 0 */
+static inline void ventilator_reg_read(ventilator_event_t *ev)
+{
+	if (ev) {
+		ev->time = VENTILATOR_IN_TIME;
+		ev->addr = VENTILATOR_IN_ADDR;
+		ev->data = VENTILATOR_IN_DATA;
+	}
+	VENTILATOR_IN_RE = 0;
+}
+
+static inline int ventilator_reg_push1(uint32_t time, uint32_t addr,
+		uint32_t data, int noblock)
+{
+	while (VENTILATOR_STATUS & VENTILATOR_EV_OUT_OVERFLOW)
+		if (noblock)
+			return 0;
+	ventilator_reg_write(time, addr, data);
+	return 1;
+}
+
+static inline int ventilator_reg_pop(ventilator_event_t *ev, int noblock)
+{
+	while (!(VENTILATOR_STATUS & VENTILATOR_EV_IN_READABLE))
+		if (noblock)
+			return 0;
+	ventilator_reg_read(ev);
+	return 1;
+}
+
+/* Checks the FIFO level once per batch, not once per event */
+static inline int ventilator_reg_push_many(const ventilator_event_t *ev,
+		int n, int noblock)
+{
+	int i = 0, k;
+	while (i < n) {
+		k = min(ventilator_reg_out_free(), n - i);
+		if (k <= 0 && noblock)
+			break;
+		for (; k > 0; k--, i++)
+			ventilator_reg_write(ev[i].time, ev[i].addr, ev[i].data);
+	}
+	return i;
+}
+
+static inline int ventilator_reg_pop_many(ventilator_event_t *ev,
+		int n, int noblock)
+{
+	int i = 0, k;
+	while (i < n) {
+		k = min((int) ventilator_reg_in_level(), n - i);
+		if (k <= 0 && noblock)
+			break;
+		for (; k > 0; k--, i++)
+			ventilator_reg_read(ev ? &ev[i] : 0);
+	}
+	return i;
+}
+#endif
+
+
 #define SYS_CLK 80e6
 #define DDS_CLK 125e6
 #define PI 3.141592653589793115998
@@ -214,27 +654,43 @@ void ventilator_kernel(ventilator_msg_t *msg);
 #define us_to_hires_cycles(time) ((uint32_t) \
 		(8*((time)*(1e-6*SYS_CLK) - us_to_cycles(time)) + .5))
 
+/* helper time unit: cycles or fine time, see VENTILATOR_FINE_TIME */
+#define us_to_time(time) ((uint32_t) \
+		((time)*((1e-6*SYS_CLK)*(1<<VENTILATOR_TIME_SHIFT)) + .5))
+
+#define time_to_us(t) (((float) (t))* \
+		(1/((1e-6*SYS_CLK)*(1<<VENTILATOR_TIME_SHIFT))))
+
+#define cycles_to_time(cycles) ((cycles) << VENTILATOR_TIME_SHIFT)
+
+/* _n counts the known free output FIFO slots */
+#define seq_start() \
+	uint32_t _t = 0; \
+	int _n = 0;
+
 #define gpio_start() \
-	uint32_t _t = 0, _c = 0, _r = 0; \
-	int (* const _v_push1)(uint32_t, uint32_t, uint32_t, int) = \
-		ventilator->push1;
+	seq_start() \
+	uint32_t _c = 0, _r = 0;
 
-#define now_cycles() _t
+#define now_cycles() (_t >> VENTILATOR_TIME_SHIFT)
 
-#define now_us() (cycles_to_us(_t))
+#define now_us() (time_to_us(_t))
 
-#define _push1(addr, data) _v_push1(_t, addr, data, 0); _t++;
+#define _push1(addr, data) \
+	while (_n <= 0) _n = ventilator_reg_out_free(); \
+	ventilator_reg_write(_t, addr, data); _n--; _t += cycles_to_time(1);
 
 #define loopback(data) _push1(VENTILATOR_CTRL_LOOPBACK, data)
 
-#define at_us(time) _t = us_to_cycles(time);
+#define at_us(time) _t = us_to_time(time);
 
-#define at_cycles(time) _t = time;
+#define at_cycles(time) _t = cycles_to_time(time);
 
-#define wait_us(time) _t += us_to_cycles(time);
+#define wait_us(time) _t += us_to_time(time);
 
-#define wait_cycles(time) _t += time;
+#define wait_cycles(time) _t += cycles_to_time(time);
 
+/* hires: addr bits 4-6, not with fine time, it is in _t */
 #define gpio_set(channels, hires) \
 	_c = (channels); _push1(VENTILATOR_GPIO_O | ((hires & 7) << 4), _c)
 
@@ -242,7 +698,8 @@ void ventilator_kernel(ventilator_msg_t *msg);
 #define gpio_off(channels, hires) gpio_set(_c & ~(channels), hires)
 
 #define gpio_pulse_us(time, channels) \
-	gpio_on(channels, 0) _t--; wait_us(time) gpio_off(channels, 0)
+	gpio_on(channels, 0) _t -= cycles_to_time(1); \
+	wait_us(time) gpio_off(channels, 0)
 
 #define gpio_open(channels) \
 	_r |= (channels); _push1(VENTILATOR_GPIO_SENSE_RISE, _r)
@@ -251,7 +708,8 @@ void ventilator_kernel(ventilator_msg_t *msg);
 	_r &= ~(channels); _push1(VENTILATOR_GPIO_SENSE_RISE, _r)
 
 #define gpio_detect_us(time, channels) \
-	gpio_open(channels) _t--; wait_us(time) gpio_close(channels)
+	gpio_open(channels) _t -= cycles_to_time(1); \
+	wait_us(time) gpio_close(channels)
 
 #define DDS_FUD			64
 #define DDS_GPIO		65
@@ -259,7 +717,7 @@ void ventilator_kernel(ventilator_msg_t *msg);
 #define dds_write1(addr, data) \
 	_push1(VENTILATOR_WISHBONE_W | VENTILATOR_WISHBONE_SEL | \
 			(VENTILATOR_WISHBONE_ADDR & (VENTILATOR_WISHBONE_DDS \
-			+ (addr))), (data)) _t++;
+			+ (addr))), (data)) _t += cycles_to_time(1);
 
 #define dds_write2(addr, data) \
 	dds_write1(addr, (data) >> 8) dds_write1((addr) + 1, data)
@@ -267,10 +725,150 @@ void ventilator_kernel(ventilator_msg_t *msg);
 #define dds_write4(addr, data) \
 	dds_write2(addr, (data) >> 16) dds_write2((addr) + 2, data)
 
+#define dds_ftw(ftw) ((uint32_t) ((ftw)*((1<<23)/(DDS_CLK/(1<<9)) + .5)))
+#define dds_ptw(ptw) ((uint32_t) ((ptw)*((1<<14)/(2*PI)) + .5))
+
 #define dds_tune(sel, ftw, ptw) \
 	dds_write1(DDS_GPIO, sel) \
-	dds_write4(0x0a, (uint32_t) ((ftw)*((1<<23)/(DDS_CLK/(1<<9)) + .5))) \
-	dds_write2(0x0e, (uint32_t) ((ptw)*((1<<14)/(2*PI)) + .5)) \
+	dds_write4(0x0a, dds_ftw(ftw)) \
+	dds_write2(0x0e, dds_ptw(ptw)) \
 	dds_write1(DDS_FUD, 0)
 
+/*
+ * Constant sequences. The seq_* macros are initializers for
+ * ventilator_event_t tables and are folded by the compiler:
+ *
+ *	static const ventilator_event_t seq[] = {
+ *		seq_gpio_us(1., AO_BD),
+ *		seq_gpio_us(1.1, 0),
+ *		seq_dds_tune_us(2., DDS_BD, 100e6, 0),
+ *	};
+ *
+ * Times are relative and must increase. push_seq(seq) pushes the
+ * table at the current seq_start()/gpio_start() time and advances it
+ * past the last event. seq_event() takes the helper time unit.
+ */
+#define seq_event(t, addr, data) {(t), (addr), (data)}
+
+/* selects the helper time unit, at time 0 while the cycle is held */
+#define seq_fine_time() \
+	seq_event(0, VENTILATOR_CTRL_FINE_TIME, VENTILATOR_FINE_TIME)
+#define seq_event_us(time, addr, data) \
+	seq_event(us_to_time(time), addr, data)
+
+#define seq_loopback_us(time, data) \
+	seq_event_us(time, VENTILATOR_CTRL_LOOPBACK, data)
+
+/* sets all outputs, with fine time seq_gpio_us() is already hires */
+#define seq_gpio_us(time, channels) \
+	seq_event_us(time, VENTILATOR_GPIO_O, channels)
+#if VENTILATOR_FINE_TIME
+#define seq_gpio_hires_us(time, channels) seq_gpio_us(time, channels)
+#else
+#define seq_gpio_hires_us(time, channels) \
+	seq_event_us(time, VENTILATOR_GPIO_O | \
+			((us_to_hires_cycles(time) & 7) << 4), channels)
+#endif
+
+/* sets all rising edge detectors */
+#define seq_sense_us(time, channels) \
+	seq_event_us(time, VENTILATOR_GPIO_SENSE_RISE, channels)
+
+/* DDS writes are two cycles apart, a tune takes 16 cycles */
+#define seq_dds_write1(t, addr, data) \
+	seq_event(t, VENTILATOR_WISHBONE_W | VENTILATOR_WISHBONE_SEL | \
+			(VENTILATOR_WISHBONE_ADDR & (VENTILATOR_WISHBONE_DDS \
+			+ (addr))), (data))
+
+#define seq_dds_write2(t, addr, data) \
+	seq_dds_write1(t, addr, (data) >> 8), \
+	seq_dds_write1((t) + cycles_to_time(2), (addr) + 1, data)
+
+#define seq_dds_write4(t, addr, data) \
+	seq_dds_write2(t, addr, (data) >> 16), \
+	seq_dds_write2((t) + cycles_to_time(4), (addr) + 2, data)
+
+#define seq_dds_tune(t, sel, ftw, ptw) \
+	seq_dds_write1(t, DDS_GPIO, sel), \
+	seq_dds_write4((t) + cycles_to_time(2), 0x0a, dds_ftw(ftw)), \
+	seq_dds_write2((t) + cycles_to_time(10), 0x0e, dds_ptw(ptw)), \
+	seq_dds_write1((t) + cycles_to_time(14), DDS_FUD, 0)
+
+#define seq_dds_tune_us(time, sel, ftw, ptw) \
+	seq_dds_tune(us_to_time(time), sel, ftw, ptw)
+
+#ifdef VENTILATOR_WB_BASE
+/*
+ * Pushes n events with their times offset by t. Blocks. *free tracks
+ * the known free output FIFO slots across calls. It stays a lower
+ * bound as long as nothing else pushes in between.
+ */
+static inline void ventilator_reg_push_seq(const ventilator_event_t *ev,
+		unsigned int n, uint32_t t, int *free)
+{
+	int k = *free;
+	for (; n; n--, ev++) {
+		while (k <= 0)
+			k = ventilator_reg_out_free();
+		ventilator_reg_write(t + ev->time, ev->addr, ev->data);
+		k--;
+	}
+	*free = k;
+}
+
+#define push_seq(seq) \
+	ventilator_reg_push_seq(seq, len(seq), _t, &_n); \
+	_t += seq[len(seq) - 1].time + cycles_to_time(1);
+
+/*
+ * Non-blocking ventilator_reg_push_seq(): pushes from *i on until the
+ * FIFO is full. Returns 1 once all n events are pushed.
+ */
+static inline int ventilator_reg_push_seq_part(const ventilator_event_t *ev,
+		unsigned int n, uint32_t t, unsigned int *i)
+{
+	int k = ventilator_reg_out_free();
+	for (; (*i < n) && (k > 0); (*i)++, k--)
+		ventilator_reg_write(t + ev[*i].time, ev[*i].addr, ev[*i].data);
+	return *i == n;
+}
+#endif
+
+/*
+ * Protothreads: sequence generators that give up the CPU while the
+ * output FIFO is full and resume on the next ventilator_kernel(NULL).
+ *
+ *	static int gen(ventilator_pt_t *pt)
+ *	{
+ *		pt_begin(pt)
+ *		...
+ *		pt_wait_until(pt, ventilator_reg_out_free())
+ *		...
+ *		pt_end(pt)
+ *	}
+ *
+ * gen() returns PT_WAITING until it is done, then PT_DONE and starts
+ * over on the next call. Locals are lost at pt_wait_until(), keep
+ * state static. No switch statements around pt_wait_until() and only
+ * one per line.
+ */
+typedef struct ventilator_pt_t {
+	unsigned int line;
+} ventilator_pt_t;
+
+#define PT_WAITING	0
+#define PT_DONE		1
+
+#define pt_init(pt) (pt)->line = 0;
+
+#define pt_begin(pt) switch ((pt)->line) { case 0:
+
+#define pt_wait_until(pt, cond) \
+	(pt)->line = __LINE__; case __LINE__: \
+	if (!(cond)) return PT_WAITING;
+
+#define pt_end(pt) } (pt)->line = 0; return PT_DONE;
+
+#endif /* __ASSEMBLER__ */
+
 #endif /* __HW_VENTILATOR_H */
@@ -0,0 +1,144 @@
+/* Robert Jordens <jordens@gmail.com>, 2014 */
+
+#ifndef __VENTILATOR_MERGE_H
+#define __VENTILATOR_MERGE_H
+
+#include <ventilator.h>
+
+/*
+ * Merges several time ordered event streams (one per channel: GPIO,
+ * DDS, markers, ...) into the output FIFO.
+ *
+ *	ventilator_merge_t m;
+ *	ventilator_merge_init(&m, t0);
+ *	ventilator_merge_add(&m, seq_gpio, len(seq_gpio));
+ *	ventilator_merge_add(&m, seq_dds, len(seq_dds));
+ *	pt_wait_until(pt, ventilator_merge_push(&m, 1))
+ *
+ * The Master dispatches the FIFO head only in the cycle equal to its
+ * time and one event at a time. An event that is not later than the
+ * previous one (plus the time its slave needs to ack) would stall the
+ * FIFO. Such events are delayed to the next usable cycle and counted
+ * in conflicts. Ties are resolved in the order the streams were added.
+ */
+#define VENTILATOR_MERGE_MAX	8
+
+typedef struct ventilator_merge_t {
+	const ventilator_event_t *ev[VENTILATOR_MERGE_MAX];
+	const ventilator_event_t *end[VENTILATOR_MERGE_MAX];
+	uint8_t heap[VENTILATOR_MERGE_MAX]; /* streams by next time */
+	unsigned int n; /* in the heap */
+	unsigned int streams; /* added */
+	uint32_t t; /* offset */
+	uint32_t next; /* earliest time for the next event */
+	unsigned int conflicts;
+} ventilator_merge_t;
+
+/* Cycles until the Master can dispatch the next event */
+static inline uint32_t ventilator_merge_gap(uint32_t addr)
+{
+	/* the wishbone bridge needs a cycle for the ack */
+	if (addr & VENTILATOR_WISHBONE)
+		return 2;
+	return 1;
+}
+
+static inline void ventilator_merge_init(ventilator_merge_t *m, uint32_t t)
+{
+	m->n = 0;
+	m->streams = 0;
+	m->t = t;
+	m->next = t;
+	m->conflicts = 0;
+}
+
+static inline int ventilator_merge_less(const ventilator_merge_t *m,
+		unsigned int a, unsigned int b)
+{
+	return (m->ev[a]->time < m->ev[b]->time) ||
+		((m->ev[a]->time == m->ev[b]->time) && (a < b));
+}
+
+static inline void ventilator_merge_down(ventilator_merge_t *m,
+		unsigned int i)
+{
+	unsigned int c;
+	uint8_t s;
+	while ((c = 2*i + 1) < m->n) {
+		if ((c + 1 < m->n) &&
+				ventilator_merge_less(m, m->heap[c + 1], m->heap[c]))
+			c++;
+		if (!ventilator_merge_less(m, m->heap[c], m->heap[i]))
+			break;
+		s = m->heap[i];
+		m->heap[i] = m->heap[c];
+		m->heap[c] = s;
+		i = c;
+	}
+}
+
+/*
+ * Adds a stream of n events with non-decreasing times before the
+ * first push. The events are not copied. Returns 0 if there are too
+ * many streams.
+ */
+static inline int ventilator_merge_add(ventilator_merge_t *m,
+		const ventilator_event_t *ev, unsigned int n)
+{
+	unsigned int i, p, k;
+	uint8_t s;
+	if (m->streams >= VENTILATOR_MERGE_MAX)
+		return 0;
+	if (!n)
+		return 1;
+	k = m->streams++;
+	m->ev[k] = ev;
+	m->end[k] = ev + n;
+	m->heap[m->n] = k;
+	i = m->n++;
+	while (i) {
+		p = (i - 1)/2;
+		if (!ventilator_merge_less(m, m->heap[i], m->heap[p]))
+			break;
+		s = m->heap[i];
+		m->heap[i] = m->heap[p];
+		m->heap[p] = s;
+		i = p;
+	}
+	return 1;
+}
+
+/*
+ * Pushes the merged events, one batch per free FIFO level reading.
+ * With noblock, returns 0 when the FIFO is full (resume later).
+ * Returns 1 once all streams are exhausted.
+ */
+static inline int ventilator_merge_push(ventilator_merge_t *m, int noblock)
+{
+	unsigned int s;
+	int k;
+	const ventilator_event_t *e;
+	uint32_t t;
+	while (m->n) {
+		k = ventilator_reg_out_free();
+		if (k <= 0 && noblock)
+			return 0;
+		for (; (k > 0) && m->n; k--) {
+			s = m->heap[0];
+			e = m->ev[s]++;
+			t = m->t + e->time;
+			if (t < m->next) {
+				m->conflicts++;
+				t = m->next;
+			}
+			ventilator_reg_write(t, e->addr, e->data);
+			m->next = t + ventilator_merge_gap(e->addr);
+			if (m->ev[s] == m->end[s])
+				m->heap[0] = m->heap[--m->n];
+			ventilator_merge_down(m, 0);
+		}
+	}
+	return 1;
+}
+
+#endif /* __VENTILATOR_MERGE_H */
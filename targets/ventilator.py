@@ -109,6 +109,7 @@ class VentilatorSoC(SDRAMSoC):
 		"test_inputs":	10,
 		"test_ttl":		11,
 		"ventilator":	12,
+		"spiflash":		13,
 	}
 	csr_map.update(SDRAMSoC.csr_map)
 	interrupt_map = {
@@ -121,7 +122,7 @@ class VentilatorSoC(SDRAMSoC):
 		SDRAMSoC.__init__(self, platform,
 			clk_freq=clk_freq,
 			cpu_reset_address=0x160000,
-			sram_size=0x400,
+			sram_size=0x2000,
 			**kwargs)
 		platform.add_extension(_ventilator_io)
 		platform.ise_commands = """